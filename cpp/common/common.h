@@ -38,7 +38,14 @@ struct AdapterDesc {
   int64_t luid;
 };
 
-enum Quality { Quality_Default, Quality_High, Quality_Medium, Quality_Low };
+// Quality_Auto: the ram encoder steps the preset to fit the frame time
+enum Quality {
+  Quality_Default,
+  Quality_High,
+  Quality_Medium,
+  Quality_Low,
+  Quality_Auto
+};
 
 enum RateControl {
   RC_DEFAULT,
@@ -0,0 +1,597 @@
+extern "C" {
+#include <libavutil/pixfmt.h>
+}
+
+#include "simd.h"
+
+#include <algorithm>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HWCODEC_SSE2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define HWCODEC_NEON
+#endif
+
+namespace util_simd {
+
+namespace {
+
+// odd and below 2^15, so the signed 16-bit multiply-add of SSE2 can't overflow
+alignas(16) const int16_t kWeights[16] = {
+    0x2f1b, 0x1a65, 0x3c6f, 0x0d2b, 0x29d3, 0x17e5, 0x3b89, 0x0a97,
+    0x1e2d, 0x33f1, 0x0c4b, 0x2a59, 0x1479, 0x3d07, 0x06a3, 0x25c5};
+alignas(16) const uint32_t kSeed[4] = {0x9e3779b9, 0x85ebca6b, 0xc2b2ae35,
+                                       0x27d4eb2f};
+
+inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// splitmix64 finalizer
+inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+inline uint64_t finalize(const uint32_t acc[4], int width, int height) {
+  uint64_t h = ((uint64_t)acc[0] << 32 | acc[1]) ^
+               rotl64((uint64_t)acc[2] << 32 | acc[3], 29);
+  h ^= (uint64_t)(uint32_t)width << 32 | (uint32_t)height;
+  return mix64(h);
+}
+
+// Every 16-byte chunk updates four 32-bit lanes with acc = acc * 33 ^ m, where
+// m[l] = b[2l]w[2l] + b[2l+1]w[2l+1] + b[2l+8]w[2l+8] + b[2l+9]w[2l+9], which
+// is exactly what _mm_madd_epi16 computes on the unpacked bytes. Row tails are
+// zero padded to a full chunk.
+#if defined(HWCODEC_SSE2)
+
+inline __m128i hash_step(__m128i acc, __m128i v, __m128i wlo, __m128i whi) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i m = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(v, zero), wlo),
+                            _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), whi));
+  return _mm_xor_si128(_mm_add_epi32(_mm_slli_epi32(acc, 5), acc), m);
+}
+
+void hash_rows(const uint8_t *src, int linesize, int width, int height,
+               uint32_t out[4]) {
+  const __m128i wlo = _mm_load_si128((const __m128i *)kWeights);
+  const __m128i whi = _mm_load_si128((const __m128i *)(kWeights + 8));
+  __m128i acc = _mm_load_si128((const __m128i *)kSeed);
+  for (int y = 0; y < height; y++) {
+    const uint8_t *row = src + (size_t)y * linesize;
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+      acc = hash_step(acc, _mm_loadu_si128((const __m128i *)(row + x)), wlo,
+                      whi);
+    }
+    if (x < width) {
+      alignas(16) uint8_t tail[16] = {0};
+      memcpy(tail, row + x, width - x);
+      acc = hash_step(acc, _mm_load_si128((const __m128i *)tail), wlo, whi);
+    }
+  }
+  _mm_storeu_si128((__m128i *)out, acc);
+}
+
+#elif defined(HWCODEC_NEON)
+
+inline uint32x4_t hash_step(uint32x4_t acc, uint8x16_t v, const uint16_t *w) {
+  uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+  uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+  uint32x4_t p0 = vmull_u16(vget_low_u16(lo), vld1_u16(w));
+  uint32x4_t p1 = vmull_u16(vget_high_u16(lo), vld1_u16(w + 4));
+  uint32x4_t p2 = vmull_u16(vget_low_u16(hi), vld1_u16(w + 8));
+  uint32x4_t p3 = vmull_u16(vget_high_u16(hi), vld1_u16(w + 12));
+  uint32x4_t m = vaddq_u32(vpaddq_u32(p0, p1), vpaddq_u32(p2, p3));
+  return veorq_u32(vaddq_u32(vshlq_n_u32(acc, 5), acc), m);
+}
+
+void hash_rows(const uint8_t *src, int linesize, int width, int height,
+               uint32_t out[4]) {
+  const uint16_t *w = (const uint16_t *)kWeights;
+  uint32x4_t acc = vld1q_u32(kSeed);
+  for (int y = 0; y < height; y++) {
+    const uint8_t *row = src + (size_t)y * linesize;
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+      acc = hash_step(acc, vld1q_u8(row + x), w);
+    }
+    if (x < width) {
+      uint8_t tail[16] = {0};
+      memcpy(tail, row + x, width - x);
+      acc = hash_step(acc, vld1q_u8(tail), w);
+    }
+  }
+  vst1q_u32(out, acc);
+}
+
+#else
+
+inline void hash_step(uint32_t acc[4], const uint8_t *b) {
+  for (int l = 0; l < 4; l++) {
+    uint32_t m = b[2 * l] * kWeights[2 * l] +
+                 b[2 * l + 1] * kWeights[2 * l + 1] +
+                 b[2 * l + 8] * kWeights[2 * l + 8] +
+                 b[2 * l + 9] * kWeights[2 * l + 9];
+    acc[l] = (acc[l] * 33) ^ m;
+  }
+}
+
+void hash_rows(const uint8_t *src, int linesize, int width, int height,
+               uint32_t out[4]) {
+  memcpy(out, kSeed, sizeof(kSeed));
+  for (int y = 0; y < height; y++) {
+    const uint8_t *row = src + (size_t)y * linesize;
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+      hash_step(out, row + x);
+    }
+    if (x < width) {
+      uint8_t tail[16] = {0};
+      memcpy(tail, row + x, width - x);
+      hash_step(out, tail);
+    }
+  }
+}
+
+#endif
+
+// Sums of 8x8 blocks for one row of blocks, sums[i] for the block at x = 8i.
+#if defined(HWCODEC_SSE2)
+
+void block_sums(const uint8_t *src, int linesize, int cols, uint32_t *sums) {
+  const __m128i zero = _mm_setzero_si128();
+  int c = 0;
+  // _mm_sad_epu8 against zero sums each 8-byte half, one block each
+  for (; c + 2 <= cols; c += 2) {
+    __m128i acc = zero;
+    for (int y = 0; y < 8; y++) {
+      __m128i v =
+          _mm_loadu_si128((const __m128i *)(src + (size_t)y * linesize + c * 8));
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+    sums[c] = (uint32_t)_mm_cvtsi128_si32(acc);
+    sums[c + 1] = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+  }
+  for (; c < cols; c++) {
+    __m128i acc = zero;
+    for (int y = 0; y < 8; y++) {
+      __m128i v =
+          _mm_loadl_epi64((const __m128i *)(src + (size_t)y * linesize + c * 8));
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+    sums[c] = (uint32_t)_mm_cvtsi128_si32(acc);
+  }
+}
+
+#elif defined(HWCODEC_NEON)
+
+void block_sums(const uint8_t *src, int linesize, int cols, uint32_t *sums) {
+  for (int c = 0; c < cols; c++) {
+    uint16x8_t acc = vdupq_n_u16(0);
+    for (int y = 0; y < 8; y++) {
+      acc = vaddw_u8(acc, vld1_u8(src + (size_t)y * linesize + c * 8));
+    }
+    sums[c] = vaddvq_u16(acc);
+  }
+}
+
+#else
+
+void block_sums(const uint8_t *src, int linesize, int cols, uint32_t *sums) {
+  for (int c = 0; c < cols; c++) {
+    uint32_t sum = 0;
+    for (int y = 0; y < 8; y++) {
+      const uint8_t *row = src + (size_t)y * linesize + c * 8;
+      for (int x = 0; x < 8; x++)
+        sum += row[x];
+    }
+    sums[c] = sum;
+  }
+}
+
+#endif
+
+// 2:1 box filter of one output row, each output sample the rounded mean of a
+// 2x2 input block. With interleaved, pairs of bytes (NV12 UV) are averaged
+// with the pair two bytes on, else single bytes with their neighbor.
+#if defined(HWCODEC_SSE2)
+
+// sum of the two rows, 16-bit, even and odd bytes apart
+inline void sum_rows(const uint8_t *r0, const uint8_t *r1, __m128i &even,
+                     __m128i &odd) {
+  const __m128i mask = _mm_set1_epi16(0x00ff);
+  __m128i a = _mm_loadu_si128((const __m128i *)r0);
+  __m128i b = _mm_loadu_si128((const __m128i *)r1);
+  even = _mm_add_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+  odd = _mm_add_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+}
+
+void downscale_row(const uint8_t *r0, const uint8_t *r1, uint8_t *dst,
+                   int width, bool interleaved) {
+  const __m128i two = _mm_set1_epi16(2);
+  int x = 0;
+  if (!interleaved) {
+    for (; x + 16 <= width; x += 16) {
+      __m128i e0, o0, e1, o1;
+      sum_rows(r0 + 2 * x, r1 + 2 * x, e0, o0);
+      sum_rows(r0 + 2 * x + 16, r1 + 2 * x + 16, e1, o1);
+      __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(e0, o0), two), 2);
+      __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(e1, o1), two), 2);
+      _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+    }
+  } else {
+    const __m128i low = _mm_set1_epi32(0xffff);
+    const __m128i two32 = _mm_set1_epi32(2);
+    // 16 input bytes are 4 pairs of pairs, 8 output bytes
+    for (; x + 8 <= width; x += 8) {
+      __m128i u, v;
+      sum_rows(r0 + 2 * x, r1 + 2 * x, u, v);
+      u = _mm_add_epi32(_mm_and_si128(u, low), _mm_srli_epi32(u, 16));
+      v = _mm_add_epi32(_mm_and_si128(v, low), _mm_srli_epi32(v, 16));
+      u = _mm_srli_epi32(_mm_add_epi32(u, two32), 2);
+      v = _mm_srli_epi32(_mm_add_epi32(v, two32), 2);
+      __m128i uv = _mm_or_si128(u, _mm_slli_epi32(v, 8));
+      // below 2^16, sign extended for the signed pack
+      uv = _mm_srai_epi32(_mm_slli_epi32(uv, 16), 16);
+      _mm_storel_epi64((__m128i *)(dst + x), _mm_packs_epi32(uv, uv));
+    }
+  }
+  const int step = interleaved ? 2 : 1;
+  for (; x < width; x++) {
+    const int i = (x / step) * 2 * step + x % step;
+    dst[x] = (uint8_t)((r0[i] + r0[i + step] + r1[i] + r1[i + step] + 2) >> 2);
+  }
+}
+
+#elif defined(HWCODEC_NEON)
+
+void downscale_row(const uint8_t *r0, const uint8_t *r1, uint8_t *dst,
+                   int width, bool interleaved) {
+  int x = 0;
+  if (!interleaved) {
+    for (; x + 8 <= width; x += 8) {
+      uint16x8_t sum = vpaddlq_u8(vld1q_u8(r0 + 2 * x));
+      sum = vpadalq_u8(sum, vld1q_u8(r1 + 2 * x));
+      vst1_u8(dst + x, vrshrn_n_u16(sum, 2));
+    }
+  } else {
+    for (; x + 16 <= width; x += 16) {
+      uint8x8x4_t a = vld4_u8(r0 + 2 * x);
+      uint8x8x4_t b = vld4_u8(r1 + 2 * x);
+      uint16x8_t u = vaddq_u16(vaddl_u8(a.val[0], a.val[2]),
+                               vaddl_u8(b.val[0], b.val[2]));
+      uint16x8_t v = vaddq_u16(vaddl_u8(a.val[1], a.val[3]),
+                               vaddl_u8(b.val[1], b.val[3]));
+      uint8x8x2_t uv = {{vrshrn_n_u16(u, 2), vrshrn_n_u16(v, 2)}};
+      vst2_u8(dst + x, uv);
+    }
+  }
+  const int step = interleaved ? 2 : 1;
+  for (; x < width; x++) {
+    const int i = (x / step) * 2 * step + x % step;
+    dst[x] = (uint8_t)((r0[i] + r0[i + step] + r1[i] + r1[i + step] + 2) >> 2);
+  }
+}
+
+#else
+
+void downscale_row(const uint8_t *r0, const uint8_t *r1, uint8_t *dst,
+                   int width, bool interleaved) {
+  const int step = interleaved ? 2 : 1;
+  for (int x = 0; x < width; x++) {
+    const int i = (x / step) * 2 * step + x % step;
+    dst[x] = (uint8_t)((r0[i] + r0[i + step] + r1[i] + r1[i + step] + 2) >> 2);
+  }
+}
+
+#endif
+
+// 3/4 scaling, every 4 samples become 3 with the weights 3:1, 1:1 and 1:3,
+// vertically and horizontally, like libyuv's ScaleRowDown34_1_Box. k is the
+// output position within its group of three.
+inline uint8_t blend34(int a, int b, int k) {
+  switch (k) {
+  case 0:
+    return (uint8_t)((3 * a + b + 2) >> 2);
+  case 1:
+    return (uint8_t)((a + b + 1) >> 1);
+  default:
+    return (uint8_t)((a + 3 * b + 2) >> 2);
+  }
+}
+
+#if defined(HWCODEC_SSE2)
+
+// (3a + b + 2) >> 2 of 8 samples widened to 16 bits
+inline __m128i blend31_epi16(__m128i a, __m128i b) {
+  const __m128i two = _mm_set1_epi16(2);
+  __m128i a3 = _mm_add_epi16(_mm_slli_epi16(a, 1), a);
+  return _mm_srli_epi16(_mm_add_epi16(a3, _mm_add_epi16(b, two)), 2);
+}
+
+void blend34_rows(const uint8_t *ra, const uint8_t *rb, uint8_t *dst, int n,
+                  int k) {
+  const __m128i zero = _mm_setzero_si128();
+  int x = 0;
+  if (k == 2) {
+    std::swap(ra, rb);
+  }
+  for (; x + 16 <= n; x += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(ra + x));
+    __m128i b = _mm_loadu_si128((const __m128i *)(rb + x));
+    __m128i d;
+    if (k == 1) {
+      d = _mm_avg_epu8(a, b);
+    } else {
+      __m128i lo = blend31_epi16(_mm_unpacklo_epi8(a, zero),
+                                 _mm_unpacklo_epi8(b, zero));
+      __m128i hi = blend31_epi16(_mm_unpackhi_epi8(a, zero),
+                                 _mm_unpackhi_epi8(b, zero));
+      d = _mm_packus_epi16(lo, hi);
+    }
+    _mm_storeu_si128((__m128i *)(dst + x), d);
+  }
+  if (k == 2) {
+    std::swap(ra, rb);
+  }
+  for (; x < n; x++)
+    dst[x] = blend34(ra[x], rb[x], k);
+}
+
+// Planar, each 32-bit lane a group of 4 samples: 16 bytes in, 12 out. The
+// 4-byte stores overlap, the spare byte is overwritten by the next group.
+int scale34_row_simd(const uint8_t *src, uint8_t *dst, int width) {
+  const __m128i mask = _mm_set1_epi32(0xff);
+  const __m128i one = _mm_set1_epi32(1);
+  const __m128i two = _mm_set1_epi32(2);
+  int o = 0;
+  for (; o + 13 <= width; o += 12) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(src + o / 3 * 4));
+    __m128i b0 = _mm_and_si128(x, mask);
+    __m128i b1 = _mm_and_si128(_mm_srli_epi32(x, 8), mask);
+    __m128i b2 = _mm_and_si128(_mm_srli_epi32(x, 16), mask);
+    __m128i b3 = _mm_srli_epi32(x, 24);
+    __m128i d0 = _mm_srli_epi32(
+        _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(b0, 1), b0),
+                      _mm_add_epi32(b1, two)),
+        2);
+    __m128i d1 = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(b1, b2), one), 1);
+    __m128i d2 = _mm_srli_epi32(
+        _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(b3, 1), b3),
+                      _mm_add_epi32(b2, two)),
+        2);
+    __m128i d = _mm_or_si128(
+        d0, _mm_or_si128(_mm_slli_epi32(d1, 8), _mm_slli_epi32(d2, 16)));
+    alignas(16) uint32_t lanes[4];
+    _mm_store_si128((__m128i *)lanes, d);
+    for (int l = 0; l < 4; l++)
+      memcpy(dst + o + 3 * l, &lanes[l], 4);
+  }
+  return o;
+}
+
+#elif defined(HWCODEC_NEON)
+
+void blend34_rows(const uint8_t *ra, const uint8_t *rb, uint8_t *dst, int n,
+                  int k) {
+  const uint8x8_t three = vdup_n_u8(3);
+  int x = 0;
+  for (; x + 16 <= n; x += 16) {
+    uint8x16_t a = vld1q_u8(ra + x);
+    uint8x16_t b = vld1q_u8(rb + x);
+    uint8x16_t d;
+    if (k == 1) {
+      d = vrhaddq_u8(a, b);
+    } else {
+      if (k == 2) {
+        uint8x16_t t = a;
+        a = b;
+        b = t;
+      }
+      uint8x8_t lo = vrshrn_n_u16(
+          vmlal_u8(vmovl_u8(vget_low_u8(b)), vget_low_u8(a), three), 2);
+      uint8x8_t hi = vrshrn_n_u16(
+          vmlal_u8(vmovl_u8(vget_high_u8(b)), vget_high_u8(a), three), 2);
+      d = vcombine_u8(lo, hi);
+    }
+    vst1q_u8(dst + x, d);
+  }
+  for (; x < n; x++)
+    dst[x] = blend34(ra[x], rb[x], k);
+}
+
+// planar, 8 groups of 4 samples: 32 bytes in, 24 out
+int scale34_row_simd(const uint8_t *src, uint8_t *dst, int width) {
+  const uint8x8_t three = vdup_n_u8(3);
+  int o = 0;
+  for (; o + 24 <= width; o += 24) {
+    uint8x8x4_t s = vld4_u8(src + o / 3 * 4);
+    uint8x8x3_t d;
+    d.val[0] = vrshrn_n_u16(vmlal_u8(vmovl_u8(s.val[1]), s.val[0], three), 2);
+    d.val[1] = vrhadd_u8(s.val[1], s.val[2]);
+    d.val[2] = vrshrn_n_u16(vmlal_u8(vmovl_u8(s.val[2]), s.val[3], three), 2);
+    vst3_u8(dst + o, d);
+  }
+  return o;
+}
+
+#else
+
+void blend34_rows(const uint8_t *ra, const uint8_t *rb, uint8_t *dst, int n,
+                  int k) {
+  for (int x = 0; x < n; x++)
+    dst[x] = blend34(ra[x], rb[x], k);
+}
+
+int scale34_row_simd(const uint8_t *, uint8_t *, int) { return 0; }
+
+#endif
+
+// n input samples (or pairs with interleaved) to width output bytes, the
+// last sample repeated where a group runs over the edge
+void scale34_row(const uint8_t *src, int n, uint8_t *dst, int width,
+                 bool interleaved) {
+  const int step = interleaved ? 2 : 1;
+  int o = 0;
+  if (!interleaved && (width + 2) / 3 * 4 <= n)
+    o = scale34_row_simd(src, dst, width);
+  for (; o < width; o++) {
+    const int p = o / step;
+    const int i = p / 3 * 4 + p % 3;
+    const int c = o % step;
+    dst[o] = blend34(src[std::min(i, n - 1) * step + c],
+                     src[std::min(i + 1, n - 1) * step + c], p % 3);
+  }
+}
+
+} // namespace
+
+void downscale_3_4(const uint8_t *src, int src_linesize, int src_width,
+                   int src_height, uint8_t *dst, int dst_linesize, int width,
+                   int height, bool interleaved) {
+  const int step = interleaved ? 2 : 1;
+  std::vector<uint8_t> row((size_t)src_width * step);
+  for (int y = 0; y < height; y++) {
+    const int i = y / 3 * 4 + y % 3;
+    const uint8_t *ra =
+        src + (size_t)std::min(i, src_height - 1) * src_linesize;
+    const uint8_t *rb =
+        src + (size_t)std::min(i + 1, src_height - 1) * src_linesize;
+    blend34_rows(ra, rb, row.data(), src_width * step, y % 3);
+    scale34_row(row.data(), src_width, dst + (size_t)y * dst_linesize,
+                width * step, interleaved);
+  }
+}
+
+void downscale_2x(const uint8_t *src, int src_linesize, uint8_t *dst,
+                  int dst_linesize, int width, int height, bool interleaved) {
+  for (int y = 0; y < height; y++) {
+    const uint8_t *r0 = src + (size_t)2 * y * src_linesize;
+    downscale_row(r0, r0 + src_linesize, dst + (size_t)y * dst_linesize, width,
+                  interleaved);
+  }
+}
+
+bool downscale_frame_2x(int pixfmt, const uint8_t *const *src,
+                        const int *src_linesize, uint8_t *const *dst,
+                        const int *dst_linesize, int width, int height) {
+  const int chroma_width = width / 2;
+  const int chroma_height = height / 2;
+  switch (pixfmt) {
+  case AV_PIX_FMT_NV12:
+    downscale_2x(src[0], src_linesize[0], dst[0], dst_linesize[0], width,
+                 height, false);
+    // interleaved UV, a chroma row holds as many bytes as a luma row
+    downscale_2x(src[1], src_linesize[1], dst[1], dst_linesize[1],
+                 chroma_width * 2, chroma_height, true);
+    return true;
+  case AV_PIX_FMT_YUV420P:
+    downscale_2x(src[0], src_linesize[0], dst[0], dst_linesize[0], width,
+                 height, false);
+    for (int p = 1; p < 3; p++)
+      downscale_2x(src[p], src_linesize[p], dst[p], dst_linesize[p],
+                   chroma_width, chroma_height, false);
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool downscale_frame(int pixfmt, const uint8_t *const *src,
+                     const int *src_linesize, int src_width, int src_height,
+                     uint8_t *const *dst, const int *dst_linesize, int width,
+                     int height, int num, int den) {
+  if (pixfmt != AV_PIX_FMT_NV12 && pixfmt != AV_PIX_FMT_YUV420P)
+    return false;
+  if (num == 1 && den == 2) {
+    // half an odd size is rounded down, the last source column or row is
+    // left out
+    if (width * 2 > src_width || height * 2 > src_height)
+      return false;
+    return downscale_frame_2x(pixfmt, src, src_linesize, dst, dst_linesize,
+                              width, height);
+  }
+  if (num != 3 || den != 4 || width > src_width || height > src_height)
+    return false;
+  const bool nv12 = pixfmt == AV_PIX_FMT_NV12;
+  downscale_3_4(src[0], src_linesize[0], src_width, src_height, dst[0],
+                dst_linesize[0], width, height, false);
+  for (int p = 1; p < (nv12 ? 2 : 3); p++)
+    downscale_3_4(src[p], src_linesize[p], src_width / 2, src_height / 2,
+                  dst[p], dst_linesize[p], width / 2, height / 2, nv12);
+  return true;
+}
+
+uint64_t hash_block(const uint8_t *src, int linesize, int width, int height) {
+  uint32_t acc[4];
+  hash_rows(src, linesize, width, height, acc);
+  return finalize(acc, width, height);
+}
+
+bool hash_frame_tiles(int pixfmt, const uint8_t *const *data,
+                      const int *linesize, int width, int height,
+                      std::vector<uint64_t> &hashes) {
+  if (pixfmt != AV_PIX_FMT_NV12 && pixfmt != AV_PIX_FMT_YUV420P)
+    return false;
+  const int half = TILE_SIZE / 2;
+  const int cols = (width + TILE_SIZE - 1) / TILE_SIZE;
+  const int rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+  const int chroma_width = (width + 1) / 2;
+  const int chroma_height = (height + 1) / 2;
+  hashes.resize((size_t)cols * rows);
+  for (int r = 0; r < rows; r++) {
+    const int y = r * TILE_SIZE;
+    const int h = std::min(TILE_SIZE, height - y);
+    const int cy = r * half;
+    const int ch = std::min(half, chroma_height - cy);
+    for (int c = 0; c < cols; c++) {
+      const int x = c * TILE_SIZE;
+      const int w = std::min(TILE_SIZE, width - x);
+      uint64_t hash =
+          hash_block(data[0] + (size_t)y * linesize[0] + x, linesize[0], w, h);
+      if (pixfmt == AV_PIX_FMT_NV12) {
+        // interleaved UV, a chroma row holds as many bytes as a luma row
+        const int cw = std::min(TILE_SIZE, chroma_width * 2 - x);
+        hash ^= rotl64(hash_block(data[1] + (size_t)cy * linesize[1] + x,
+                                  linesize[1], cw, ch),
+                       21);
+      } else {
+        const int cx = c * half;
+        const int cw = std::min(half, chroma_width - cx);
+        hash ^= rotl64(hash_block(data[1] + (size_t)cy * linesize[1] + cx,
+                                  linesize[1], cw, ch),
+                       21);
+        hash ^= rotl64(hash_block(data[2] + (size_t)cy * linesize[2] + cx,
+                                  linesize[2], cw, ch),
+                       42);
+      }
+      hashes[(size_t)r * cols + c] = hash;
+    }
+  }
+  return true;
+}
+
+void block_means(const uint8_t *src, int linesize, int width, int height,
+                 std::vector<uint8_t> &means) {
+  const int cols = width / 8;
+  const int rows = height / 8;
+  std::vector<uint32_t> sums(cols);
+  means.resize((size_t)cols * rows);
+  for (int r = 0; r < rows; r++) {
+    block_sums(src + (size_t)r * 8 * linesize, linesize, cols, sums.data());
+    for (int c = 0; c < cols; c++)
+      means[(size_t)r * cols + c] = (uint8_t)((sums[c] + 32) >> 6);
+  }
+}
+
+} // namespace util_simd
@@ -0,0 +1,58 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <stdint.h>
+#include <vector>
+
+namespace util_simd {
+
+// luma tile edge, chroma tiles cover the same picture area
+constexpr int TILE_SIZE = 64;
+
+// 64-bit hash of a width x height block of 8-bit samples. SSE2/NEON when
+// available, the scalar path yields the same values.
+uint64_t hash_block(const uint8_t *src, int linesize, int width, int height);
+
+// One hash per TILE_SIZE x TILE_SIZE luma tile of a NV12 or YUV420P frame,
+// chroma folded in, row-major. Returns false for other pixel formats.
+bool hash_frame_tiles(int pixfmt, const uint8_t *const *data,
+                      const int *linesize, int width, int height,
+                      std::vector<uint64_t> &hashes);
+
+// Mean of every full 8x8 block of an 8-bit plane, row-major, (width / 8) *
+// (height / 8) values. Partial blocks at the right and bottom are left out.
+void block_means(const uint8_t *src, int linesize, int width, int height,
+                 std::vector<uint8_t> &means);
+
+// 2:1 box downscale of an 8-bit plane, width x height is the output size.
+// With interleaved the plane holds byte pairs (NV12 UV), averaged as pairs.
+// The SSE2/NEON paths round like the scalar one, the output is identical.
+void downscale_2x(const uint8_t *src, int src_linesize, uint8_t *dst,
+                  int dst_linesize, int width, int height, bool interleaved);
+
+// downscale_2x of every plane of a NV12 or YUV420P frame, width x height is
+// the output luma size. Returns false for other pixel formats.
+bool downscale_frame_2x(int pixfmt, const uint8_t *const *src,
+                        const int *src_linesize, uint8_t *const *dst,
+                        const int *dst_linesize, int width, int height);
+
+// 3/4 downscale of an 8-bit plane with the 3:1, 1:1, 1:3 box weights of
+// libyuv, width x height the output size, about 3/4 of the source; the edge
+// samples are repeated where the groups of 4 run over. Sizes in samples, a
+// NV12 UV pair counts as one with interleaved.
+void downscale_3_4(const uint8_t *src, int src_linesize, int src_width,
+                   int src_height, uint8_t *dst, int dst_linesize, int width,
+                   int height, bool interleaved);
+
+// NV12 or YUV420P frame to width x height, num/den of its size rounded down:
+// 1/2 (downscale_frame_2x) or 3/4 (downscale_3_4). The ratio picks the
+// kernel, the sizes alone can't tell an odd half from 3/4. Returns false for
+// other formats, ratios or upscaling.
+bool downscale_frame(int pixfmt, const uint8_t *const *src,
+                     const int *src_linesize, int src_width, int src_height,
+                     uint8_t *const *dst, const int *dst_linesize, int width,
+                     int height, int num, int den);
+
+} // namespace util_simd
+
+#endif // SIMD_H
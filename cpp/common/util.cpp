@@ -3,6 +3,7 @@ extern "C" {
 }
 
 #include "util.h"
+#include <algorithm>
 #include <limits>
 #include <map>
 #include <string.h>
@@ -38,6 +39,12 @@ void set_av_codec_ctx(AVCodecContext *c, const std::string &name, int kbs,
     if (name.find("qsv") != std::string::npos) {
       c->rc_max_rate = c->bit_rate;
       c->bit_rate--; // cbr with vbr
+    } else if (name.find("libx264") != std::string::npos) {
+      // a one second vbv, without one x264_encoder_reconfig ignores a new
+      // bitrate and change_bit_rate has to reopen
+      c->rc_max_rate = c->bit_rate;
+      c->rc_buffer_size = (int)std::min(
+          c->bit_rate, (int64_t)std::numeric_limits<int>::max());
     }
   }
   /* frames per second */
@@ -196,12 +203,126 @@ bool set_quality(void *priv_data, const std::string &name, int quality) {
   return true;
 }
 
+// Presets by speed level, best quality first. nvenc above p4 isn't zero
+// latency, x264 and x265 slower than medium can't keep up in real time.
+static std::vector<std::string> speed_presets(const std::string &name,
+                                              std::string &option) {
+  option = "preset";
+  if (name.find("libx264") != std::string::npos ||
+      name.find("libx265") != std::string::npos) {
+    return {"medium",   "fast",      "faster",
+            "veryfast", "superfast", "ultrafast"};
+  }
+  if (name.find("nvenc") != std::string::npos) {
+    return {"p4", "p3", "p2", "p1"};
+  }
+  if (name.find("qsv") != std::string::npos) {
+    return {"medium", "fast", "faster", "veryfast"};
+  }
+  if (name.find("amf") != std::string::npos) {
+    option = "quality";
+    return {"quality", "balanced", "speed"};
+  }
+  return {};
+}
+
+int speed_levels(const std::string &name) {
+  std::string option;
+  return (int)speed_presets(name, option).size();
+}
+
+bool set_speed(void *priv_data, const std::string &name, int level) {
+  int ret;
+  std::string option;
+  std::vector<std::string> presets = speed_presets(name, option);
+  if (presets.empty())
+    return false;
+  level = std::max(0, std::min(level, (int)presets.size() - 1));
+  if ((ret = av_opt_set(priv_data, option.c_str(), presets[level].c_str(),
+                        0)) < 0) {
+    LOG_ERROR(name + " set opt " + option + " " + presets[level] +
+              " failed, ret = " + av_err2str(ret));
+    return false;
+  }
+  return true;
+}
+
 struct CodecOptions {
   std::string codec_name;
   std::string option_name;
   std::map<int, std::string> rc_values;
 };
 
+// Constant quality with the bitrate from set_av_codec_ctx as a cap, enforced
+// by a one second vbv. Mostly static content then costs far less than the
+// cap. q is crf for x264/x265, cq for nvenc and the global quality for vaapi.
+static bool set_capped_quality(AVCodecContext *c, const std::string &name,
+                               int q) {
+  int ret;
+  int64_t cap = c->bit_rate;
+  if (q < 0 || q > 51)
+    q = 23;
+  if (name.find("libx264") != std::string::npos ||
+      name.find("libx265") != std::string::npos) {
+    if ((ret = av_opt_set_double(c->priv_data, "crf", q, 0)) < 0) {
+      LOG_ERROR(name + " set opt crf failed, ret = " + av_err2str(ret));
+      return false;
+    }
+    c->bit_rate = 0;
+  } else if (name.find("nvenc") != std::string::npos) {
+    if ((ret = av_opt_set(c->priv_data, "rc", "vbr", 0)) < 0 ||
+        (ret = av_opt_set_double(c->priv_data, "cq", q, 0)) < 0) {
+      LOG_ERROR(name + " set opt rc vbr cq failed, ret = " + av_err2str(ret));
+      return false;
+    }
+    c->bit_rate = 0;
+  } else if (name.find("vaapi") != std::string::npos) {
+    // rc_mode stays auto: with a bitrate and a quality vaapi_encode picks
+    // QVBR, which takes bit_rate as the upper bound, and falls back to ICQ
+    // or CQP, uncapped, on drivers without it instead of failing to open
+    c->global_quality = q;
+  } else {
+    LOG_WARN("constant quality not supported, name: " + name);
+    return false;
+  }
+  if (cap > 0) {
+    c->rc_max_rate = cap;
+    c->rc_buffer_size =
+        (int)std::min(cap, (int64_t)std::numeric_limits<int>::max());
+  }
+  return true;
+}
+
+// Bounds the encoded frame size through the vbv: a buffer of one capped frame
+// drained at the max rate, the single-frame vbv of x264. Never smaller than an
+// average frame, which the rate control could not meet. qsv and amf also take
+// an explicit max frame size. Must run after set_rate_control.
+bool set_frame_cap(AVCodecContext *c, const std::string &name, int bytes) {
+  int ret;
+  if (bytes <= 0)
+    return true;
+  if (c->rc_max_rate <= 0)
+    c->rc_max_rate = c->bit_rate;
+  int64_t bits = (int64_t)bytes * 8;
+  if (c->rc_max_rate > 0 && c->framerate.num > 0) {
+    bits = std::max(bits, c->rc_max_rate * c->framerate.den / c->framerate.num);
+  }
+  c->rc_buffer_size =
+      (int)std::min(bits, (int64_t)std::numeric_limits<int>::max());
+  if (name.find("qsv") != std::string::npos) {
+    if ((ret = av_opt_set_int(c->priv_data, "max_frame_size", bytes, 0)) < 0) {
+      LOG_ERROR("qsv set opt max_frame_size failed, ret = " + av_err2str(ret));
+      return false;
+    }
+  } else if (name.find("amf") != std::string::npos) {
+    if ((ret = av_opt_set_int(c->priv_data, "max_au_size", bits, 0)) < 0) {
+      LOG_ERROR("amf set opt max_au_size failed, ret = " + av_err2str(ret));
+      return false;
+    }
+  }
+  return true;
+}
+
 bool set_rate_control(AVCodecContext *c, const std::string &name, int rc,
                       int q) {
   if (name.find("qsv") != std::string::npos) {
@@ -217,6 +338,9 @@ bool set_rate_control(AVCodecContext *c, const std::string &name, int rc,
       // {"videotoolbox", "constant_bit_rate", {{RC_CBR, "1"}}},
     };
 
+  if (rc == RC_CQ && name.find("mediacodec") == std::string::npos)
+    return set_capped_quality(c, name, q);
+
   for (const auto &codec : codecs) {
     if (name.find(codec.codec_name) != std::string::npos) {
       auto it = codec.rc_values.find(rc);
@@ -285,21 +409,169 @@ bool set_others(void *priv_data, const std::string &name) {
     }
   }
   if (name.find("vaapi") != std::string::npos) {
+    // only stops natural IDRs, a frame sent with AV_PICTURE_TYPE_I is still
+    // forced to IDR by vaapi_encode
     if ((ret = av_opt_set_int(priv_data, "idr_interval",
                               std::numeric_limits<int>::max(), 0)) < 0) {
       LOG_ERROR("vaapi set idr_interval failed, ret = " + av_err2str(ret));
       return false;
     }
   }
+  // make AV_PICTURE_TYPE_I frames IDR instead of plain I-frames, amf and
+  // videotoolbox do it unconditionally
+  if (name.find("nvenc") != std::string::npos ||
+      name.find("libx264") != std::string::npos) {
+    if ((ret = av_opt_set_int(priv_data, "forced-idr", 1, 0)) < 0) {
+      LOG_ERROR(name + " set forced-idr failed, ret = " + av_err2str(ret));
+      return false;
+    }
+  }
+  if (name.find("qsv") != std::string::npos) {
+    if ((ret = av_opt_set_int(priv_data, "forced_idr", 1, 0)) < 0) {
+      LOG_ERROR("qsv set forced_idr failed, ret = " + av_err2str(ret));
+      return false;
+    }
+  }
   return true;
 }
 
-bool change_bit_rate(AVCodecContext *c, const std::string &name, int kbs) {
-  if (kbs > 0) {
-    c->bit_rate = kbs * 1000;
-    if (name.find("qsv") != std::string::npos) {
-      c->rc_max_rate = c->bit_rate;
+// Refresh the picture with a moving intra column over `period` frames instead
+// of periodic keyframes. Must run after set_av_codec_ctx, x264, x265 and nvenc
+// take the refresh period from gop_size. An encoder without intra refresh
+// gets period 0 and keeps its keyframes, false is a failed option.
+bool set_intra_refresh(AVCodecContext *c, const std::string &name,
+                       int &period) {
+  int ret;
+  if (period <= 0)
+    return true;
+  if (name.find("nvenc") != std::string::npos ||
+      name.find("libx264") != std::string::npos) {
+    if ((ret = av_opt_set_int(c->priv_data, "intra-refresh", 1, 0)) < 0) {
+      LOG_ERROR(name + " set intra-refresh failed, ret = " + av_err2str(ret));
+      return false;
     }
+    c->gop_size = period;
+  } else if (name.find("libx265") != std::string::npos) {
+    if ((ret = av_opt_set(c->priv_data, "x265-params", "intra-refresh=1",
+                          0)) < 0) {
+      LOG_ERROR("libx265 set intra-refresh failed, ret = " + av_err2str(ret));
+      return false;
+    }
+    c->gop_size = period;
+  } else if (name.find("qsv") != std::string::npos) {
+    if ((ret = av_opt_set(c->priv_data, "int_ref_type", "vertical", 0)) < 0) {
+      LOG_ERROR("qsv set int_ref_type failed, ret = " + av_err2str(ret));
+      return false;
+    }
+    if ((ret = av_opt_set_int(c->priv_data, "int_ref_cycle_size", period,
+                              0)) < 0) {
+      LOG_ERROR("qsv set int_ref_cycle_size failed, ret = " +
+                av_err2str(ret));
+      return false;
+    }
+  } else if (name.find("h264_amf") != std::string::npos) {
+    // amf counts macroblocks refreshed per frame
+    int mbs = ((c->width + 15) / 16) * ((c->height + 15) / 16);
+    if ((ret = av_opt_set_int(c->priv_data, "intra_refresh_mb",
+                              (mbs + period - 1) / period, 0)) < 0) {
+      LOG_ERROR("amf set intra_refresh_mb failed, ret = " + av_err2str(ret));
+      return false;
+    }
+  } else {
+    LOG_WARN("intra refresh not supported, name: " + name);
+    period = 0;
+  }
+  return true;
+}
+
+// Temporal scalability through libvpx's predefined patterns, L1T2 is
+// 0,1,0,1 and L1T3 is 0,2,1,2. Layer n only references layers <= n, so a
+// forwarder may drop the higher ones. Targets are cumulative, 60% of the
+// bitrate in the base layer for L1T2, 40% and 60% for L1T3. ffmpeg exposes no
+// temporal layers for the h264/hevc/av1 encoders.
+bool set_temporal_layers(AVCodecContext *c, const std::string &name,
+                         int layers) {
+  int ret;
+  if (layers <= 1)
+    return true;
+  if (name.find("libvpx") == std::string::npos) {
+    LOG_WARN("temporal layers not supported, name: " + name);
+    return false;
+  }
+  // capped quality has only the cap
+  int64_t kbs = (c->bit_rate > 0 ? c->bit_rate : c->rc_max_rate) / 1000;
+  std::string params;
+  if (layers == 2) {
+    params = "ts_number_layers=2:ts_target_bitrate=" +
+             std::to_string(kbs * 6 / 10) + "," + std::to_string(kbs) +
+             ":ts_rate_decimator=2,1:ts_periodicity=2:ts_layer_id=0,1"
+             ":ts_layering_mode=2";
+  } else {
+    params = "ts_number_layers=3:ts_target_bitrate=" +
+             std::to_string(kbs * 4 / 10) + "," + std::to_string(kbs * 6 / 10) +
+             "," + std::to_string(kbs) +
+             ":ts_rate_decimator=4,2,1:ts_periodicity=4:ts_layer_id=0,2,1,2"
+             ":ts_layering_mode=3";
+  }
+  if ((ret = av_opt_set(c->priv_data, "ts-parameters", params.c_str(), 0)) <
+      0) {
+    LOG_ERROR(name + " set ts-parameters failed, ret = " + av_err2str(ret));
+    return false;
+  }
+  return true;
+}
+
+// layer of the nth frame since open or a forced keyframe, see
+// set_temporal_layers
+int temporal_layer(int layers, int64_t frame) {
+  static const int l1t2[] = {0, 1};
+  static const int l1t3[] = {0, 2, 1, 2};
+  if (layers == 2)
+    return l1t2[frame % 2];
+  if (layers >= 3)
+    return l1t3[frame % 4];
+  return 0;
+}
+
+// Returns false, leaving c as it is, if the encoder only reads the bitrate on
+// open. libx264, nvenc and qsv compare these fields with their config on every
+// frame and reconfigure in place, libx264 only if it was opened with a vbv,
+// as set_av_codec_ctx does, x264_encoder_reconfig ignores the bitrate
+// otherwise. The vbv size and max rate follow the bitrate, nvenc keeps its
+// default vbv of two seconds, sized at open, unless told otherwise.
+bool change_bit_rate(AVCodecContext *c, const std::string &name, int kbs) {
+  bool qsv = name.find("qsv") != std::string::npos;
+  bool nvenc = name.find("nvenc") != std::string::npos;
+  bool x264 = name.find("libx264") != std::string::npos &&
+              c->rc_max_rate > 0 && c->rc_buffer_size > 0;
+  if (kbs <= 0 || !(x264 || nvenc || qsv))
+    return false;
+  int64_t bit_rate = (int64_t)kbs * 1000;
+  if (!qsv && c->bit_rate <= 0 && c->rc_max_rate > 0) {
+    // capped constant quality, the bitrate is the cap
+    c->rc_buffer_size = (int)std::min(c->rc_buffer_size * (double)bit_rate /
+                                          c->rc_max_rate,
+                                      (double)std::numeric_limits<int>::max());
+    c->rc_max_rate = bit_rate;
+    return true;
+  }
+  int64_t old_bit_rate = qsv ? c->rc_max_rate : c->bit_rate;
+  if (old_bit_rate > 0) {
+    double scale = (double)bit_rate / old_bit_rate;
+    if (c->rc_buffer_size > 0)
+      c->rc_buffer_size = (int)std::min(c->rc_buffer_size * scale,
+                                        (double)std::numeric_limits<int>::max());
+    if (c->rc_max_rate > 0)
+      c->rc_max_rate = (int64_t)(c->rc_max_rate * scale);
+  }
+  if (nvenc && c->rc_buffer_size <= 0) {
+    c->rc_buffer_size =
+        (int)std::min(2 * bit_rate, (int64_t)std::numeric_limits<int>::max());
+  }
+  c->bit_rate = bit_rate;
+  if (qsv) {
+    c->rc_max_rate = bit_rate;
+    c->bit_rate--; // cbr with vbr, as in set_av_codec_ctx
   }
   return true;
 }
@@ -326,6 +598,26 @@ bool has_flag_could_not_find_ref_with_poc() {
   return v;
 }
 
+// Cheaper decoding for a cpu that can't keep up. Level 1 only touches
+// non-reference frames, so the picture stays intact. From level 2 on the
+// loop filter is skipped on references too and errors drift until the next
+// keyframe, level 3 drops non-reference frames altogether. The fields are read
+// per frame, so a change applies from the next packet.
+int speed_levels() { return 4; }
+
+void set_speed(AVCodecContext *c, int level) {
+  level = std::max(0, std::min(level, speed_levels() - 1));
+  if (level >= 1)
+    c->flags2 |= AV_CODEC_FLAG2_FAST;
+  else
+    c->flags2 &= ~AV_CODEC_FLAG2_FAST;
+  c->skip_loop_filter = level >= 2   ? AVDISCARD_ALL
+                        : level >= 1 ? AVDISCARD_NONREF
+                                     : AVDISCARD_DEFAULT;
+  c->skip_idct = level >= 2 ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+  c->skip_frame = level >= 3 ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+}
+
 } // namespace util_decode
 
 extern "C" void hwcodec_set_flag_could_not_find_ref_with_poc() {
@@ -13,11 +13,20 @@ void set_av_codec_ctx(AVCodecContext *c, const std::string &name, int kbs,
                       int gop, int fps);
 bool set_lantency_free(void *priv_data, const std::string &name);
 bool set_quality(void *priv_data, const std::string &name, int quality);
+int speed_levels(const std::string &name);
+bool set_speed(void *priv_data, const std::string &name, int level);
 bool set_rate_control(AVCodecContext *c, const std::string &name, int rc,
                       int q);
+bool set_frame_cap(AVCodecContext *c, const std::string &name, int bytes);
 bool set_gpu(void *priv_data, const std::string &name, int gpu);
 bool force_hw(void *priv_data, const std::string &name);
 bool set_others(void *priv_data, const std::string &name);
+bool set_intra_refresh(AVCodecContext *c, const std::string &name,
+                       int &period);
+
+bool set_temporal_layers(AVCodecContext *c, const std::string &name,
+                         int layers);
+int temporal_layer(int layers, int64_t frame);
 
 bool change_bit_rate(AVCodecContext *c, const std::string &name, int kbs);
 void vram_encode_test_callback(const uint8_t *data, int32_t len, int32_t key, const void *obj, int64_t pts);
@@ -26,6 +35,8 @@ void vram_encode_test_callback(const uint8_t *data, int32_t len, int32_t key, co
 
 namespace util_decode {
     bool has_flag_could_not_find_ref_with_poc();
+    int speed_levels();
+    void set_speed(AVCodecContext *c, int level);
 }
 
 namespace util {
@@ -13,6 +13,7 @@ extern "C" {
 
 #define LOG_MODULE "FFMPEG_RAM_DEC"
 #include <log.h>
+#include <simd.h>
 #include <util.h>
 
 #ifdef _WIN32
@@ -24,11 +25,14 @@ extern "C" {
 
 // #define CFG_PKG_TRACE
 
+#define MAX_PREVIEW_SHIFT 3
+
 namespace {
 typedef void (*RamDecodeCallback)(const void *obj, int width, int height,
                                   enum AVPixelFormat pixfmt,
                                   int linesize[AV_NUM_DATA_POINTERS],
-                                  uint8_t *data[AV_NUM_DATA_POINTERS], int key);
+                                  uint8_t *data[AV_NUM_DATA_POINTERS], int key,
+                                  int changed);
 
 class FFmpegRamDecoder {
 public:
@@ -44,6 +48,23 @@ public:
   int thread_count_ = 1;
   RamDecodeCallback callback_ = NULL;
   DataFormat data_format_;
+  // of the last output frame, see do_decode
+  int width_ = 0;
+  int height_ = 0;
+  int pixfmt_ = AV_PIX_FMT_NONE;
+  // see util_decode::set_speed, auto_speed_ lets adapt_speed step it
+  int speed_level_ = 0;
+  bool auto_speed_ = false;
+  double decode_ms_ = 0;   // moving averages since the last speed change
+  double interval_ms_ = 0; // between packets
+  int speed_frames_ = 0;
+  std::chrono::steady_clock::time_point last_start_;
+  std::chrono::steady_clock::time_point speed_changed_;
+  // preview mode, see set_preview
+  bool keyframe_only_ = false;
+  bool key_wait_ = false; // keyframe_only_ was cleared, skipping until a key
+  int preview_shift_ = 0;
+  AVFrame *preview_[MAX_PREVIEW_SHIFT] = {};
 
 #ifdef CFG_PKG_TRACE
   int in_ = 0;
@@ -71,6 +92,10 @@ public:
       avcodec_free_context(&c_);
     if (hw_device_ctx_)
       av_buffer_unref(&hw_device_ctx_);
+    for (int i = 0; i < MAX_PREVIEW_SHIFT; i++) {
+      if (preview_[i])
+        av_frame_free(&preview_[i]);
+    }
 
     frame_ = NULL;
     pkt_ = NULL;
@@ -143,6 +168,9 @@ public:
       return -1;
     }
 
+    key_wait_ = false;
+    apply_speed();
+
     if ((ret = avcodec_open2(c_, codec, NULL)) != 0) {
       LOG_ERROR("avcodec_open2 failed, ret = " + av_err2str(ret));
       return -1;
@@ -151,10 +179,31 @@ public:
     in_ = 0;
     out_ = 0;
 #endif
+    width_ = 0;
+    height_ = 0;
+    pixfmt_ = AV_PIX_FMT_NONE;
+    speed_frames_ = 0;
+    speed_changed_ = util::now();
 
     return 0;
   }
 
+  // level < 0 hands the level to adapt_speed, starting from the current one
+  void set_speed(int level) {
+    auto_speed_ = level < 0;
+    if (auto_speed_)
+      return;
+    level = std::min(level, util_decode::speed_levels() - 1);
+    if (level != speed_level_) {
+      LOG_INFO("decode speed level " + std::to_string(speed_level_) + " -> " +
+               std::to_string(level) + ", name: " + name_);
+      speed_level_ = level;
+      apply_speed();
+    }
+    speed_frames_ = 0;
+    speed_changed_ = util::now();
+  }
+
   int decode(const uint8_t *data, int length, const void *obj) {
     int ret = -1;
 #ifdef CFG_PKG_TRACE
@@ -168,12 +217,47 @@ public:
     }
     pkt_->data = (uint8_t *)data;
     pkt_->size = length;
+    auto start = util::now();
     ret = do_decode(obj);
+    adapt_speed(start);
+    return ret;
+  }
+
+  // For previews: keyframe_only decodes keyframes only, the other packets
+  // are parsed and dropped and produce no frame. Output is halved shift times.
+  // Leaving keyframe_only keeps skipping until the next keyframe, the frames
+  // in between reference pictures that were never decoded.
+  int set_preview(bool keyframe_only, int shift) {
+    if (shift < 0 || shift > MAX_PREVIEW_SHIFT) {
+      LOG_ERROR("unsupported preview shift " + std::to_string(shift));
+      return -1;
+    }
+    if (keyframe_only_ && !keyframe_only)
+      key_wait_ = true;
+    keyframe_only_ = keyframe_only;
+    preview_shift_ = shift;
+    apply_speed();
+    return 0;
+  }
+
+  // Like decode, but instead of a callback per frame only the newest frame
+  // of the packet is returned, as a reference the caller frees.
+  int decode_latest(const uint8_t *data, int length, AVFrame **latest) {
+    *latest = NULL;
+    if (!data || !length) {
+      LOG_ERROR("illegal decode parameter");
+      return -1;
+    }
+    pkt_->data = (uint8_t *)data;
+    pkt_->size = length;
+    auto start = util::now();
+    int ret = do_decode(NULL, latest);
+    adapt_speed(start);
     return ret;
   }
 
 private:
-  int do_decode(const void *obj) {
+  int do_decode(const void *obj, AVFrame **latest = NULL) {
     int ret;
     AVFrame *tmp_frame = NULL;
     bool decoded = false;
@@ -191,12 +275,34 @@ private:
         }
         goto _exit;
       }
+#if FF_API_FRAME_KEY
+      if (key_wait_ && (frame_->flags & AV_FRAME_FLAG_KEY)) {
+#else
+      if (key_wait_ && frame_->key_frame) {
+#endif
+        key_wait_ = false;
+        apply_speed();
+      }
+      if (latest) {
+        if ((ret = keep_latest(latest)) < 0)
+          goto _exit;
+        decoded = true;
+        continue;
+      }
 
       if (hwaccel_) {
         if (!frame_->hw_frames_ctx) {
           LOG_ERROR("hw_frames_ctx is NULL");
           goto _exit;
         }
+        // the transfer reuses the buffers of sw_frame_, sized on the last
+        // frame, so they are dropped when the stream changes
+        AVHWFramesContext *frames_ctx =
+            (AVHWFramesContext *)frame_->hw_frames_ctx->data;
+        if (sw_frame_->buf[0] && (sw_frame_->width != frame_->width ||
+                                  sw_frame_->height != frame_->height ||
+                                  sw_frame_->format != frames_ctx->sw_format))
+          av_frame_unref(sw_frame_);
         if ((ret = av_hwframe_transfer_data(sw_frame_, frame_, 0)) < 0) {
           LOG_ERROR("av_hwframe_transfer_data failed, ret = " +
                     av_err2str(ret));
@@ -207,6 +313,10 @@ private:
       } else {
         tmp_frame = frame_;
       }
+      if (preview_shift_ > 0 && !(tmp_frame = downscale(tmp_frame))) {
+        ret = -1;
+        goto _exit;
+      }
       decoded = true;
 #ifdef CFG_PKG_TRACE
       out_++;
@@ -218,13 +328,176 @@ private:
       int key_frame = frame_->key_frame;
 #endif
 
+      // A new SPS may change the geometry or format mid-stream, the decoder
+      // follows it, the caller is told to resize its buffers
+      bool changed = tmp_frame->width != width_ ||
+                     tmp_frame->height != height_ ||
+                     tmp_frame->format != pixfmt_;
+      if (changed) {
+        LOG_INFO("decode format " + std::to_string(width_) + "x" +
+                 std::to_string(height_) + " " + std::to_string(pixfmt_) +
+                 " -> " + std::to_string(tmp_frame->width) + "x" +
+                 std::to_string(tmp_frame->height) + " " +
+                 std::to_string(tmp_frame->format));
+        width_ = tmp_frame->width;
+        height_ = tmp_frame->height;
+        pixfmt_ = tmp_frame->format;
+      }
+
       callback_(obj, tmp_frame->width, tmp_frame->height,
                 (AVPixelFormat)tmp_frame->format, tmp_frame->linesize,
-                tmp_frame->data, key_frame);
+                tmp_frame->data, key_frame, changed);
     }
   _exit:
     av_packet_unref(pkt_);
-    return decoded ? 0 : -1;
+    // a packet dropped by skip_frame (keyframe only, or a speed level that
+    // discards non-reference frames) isn't an error: sent, but nothing to
+    // receive
+    bool skipped = ret == AVERROR(EAGAIN) && c_->skip_frame > AVDISCARD_DEFAULT;
+    return decoded || skipped ? 0 : -1;
+  }
+
+  void apply_speed() {
+    util_decode::set_speed(c_, speed_level_);
+    if (keyframe_only_ || key_wait_)
+      c_->skip_frame = AVDISCARD_NONKEY;
+  }
+
+  // src halved preview_shift_ times into preview_, NULL on failure. Stops
+  // early when the picture gets too small.
+  AVFrame *downscale(AVFrame *src) {
+    int ret;
+    for (int i = 0; i < preview_shift_; i++) {
+      int width = (src->width / 2) & ~1;
+      int height = (src->height / 2) & ~1;
+      if (width < 16 || height < 16)
+        break;
+      AVFrame *&dst = preview_[i];
+      if (dst && (dst->width != width || dst->height != height ||
+                  dst->format != src->format))
+        av_frame_free(&dst);
+      // still referenced by a frame of decode_latest: a fresh buffer instead
+      // of av_frame_make_writable, whose copy would be overwritten anyway
+      if (dst && !av_frame_is_writable(dst))
+        av_frame_unref(dst);
+      if (!dst && !(dst = av_frame_alloc())) {
+        LOG_ERROR("av_frame_alloc failed");
+        return NULL;
+      }
+      if (!dst->buf[0]) {
+        dst->format = src->format;
+        dst->width = width;
+        dst->height = height;
+        if ((ret = av_frame_get_buffer(dst, 32)) < 0) {
+          LOG_ERROR("av_frame_get_buffer failed, ret = " + av_err2str(ret));
+          av_frame_free(&dst);
+          return NULL;
+        }
+      }
+      if (!util_simd::downscale_frame_2x(src->format, src->data, src->linesize,
+                                         dst->data, dst->linesize, width,
+                                         height)) {
+        LOG_ERROR("unsupported preview pixfmt " + std::to_string(src->format));
+        return NULL;
+      }
+      if ((ret = av_frame_copy_props(dst, src)) < 0) {
+        LOG_ERROR("av_frame_copy_props failed, ret = " + av_err2str(ret));
+        return NULL;
+      }
+      src = dst;
+    }
+    return src;
+  }
+
+  // A reference instead of a copy, the decoder's buffer stays alive until the
+  // caller frees it. hw frames are downloaded into a new frame, sw_frame_ is
+  // overwritten by the next one.
+  int keep_latest(AVFrame **latest) {
+    int ret;
+    AVFrame *out = av_frame_alloc();
+    if (!out) {
+      LOG_ERROR("av_frame_alloc failed");
+      return AVERROR(ENOMEM);
+    }
+    if (hwaccel_) {
+      if (!frame_->hw_frames_ctx) {
+        LOG_ERROR("hw_frames_ctx is NULL");
+        av_frame_free(&out);
+        return -1;
+      }
+      if ((ret = av_hwframe_transfer_data(out, frame_, 0)) >= 0)
+        ret = av_frame_copy_props(out, frame_);
+    } else {
+      ret = av_frame_ref(out, frame_);
+    }
+    if (ret < 0) {
+      LOG_ERROR("keep latest frame failed, ret = " + av_err2str(ret));
+      av_frame_free(&out);
+      return ret;
+    }
+    if (preview_shift_ > 0) {
+      AVFrame *small = downscale(out);
+      if (!small) {
+        av_frame_free(&out);
+        return -1;
+      }
+      if (small != out) {
+        av_frame_unref(out);
+        if ((ret = av_frame_ref(out, small)) < 0) {
+          LOG_ERROR("av_frame_ref failed, ret = " + av_err2str(ret));
+          av_frame_free(&out);
+          return ret;
+        }
+      }
+    }
+    if (*latest)
+      av_frame_free(latest);
+    *latest = out;
+    return 0;
+  }
+
+  // A decoder that falls behind gets packets back to back, so the interval
+  // shrinks to the decode time itself. Above 80% of the interval the level
+  // steps up after a second at the current level, below 30% it steps back
+  // down after ten, the quiet period avoids oscillating.
+  void adapt_speed(std::chrono::steady_clock::time_point start) {
+    auto now = util::now();
+    double decode_ms =
+        std::chrono::duration<double, std::milli>(now - start).count();
+    if (speed_frames_ > 0) {
+      // a pause in the stream isn't a frame interval
+      double interval = std::min(
+          std::chrono::duration<double, std::milli>(start - last_start_)
+              .count(),
+          1000.0);
+      interval_ms_ = speed_frames_ == 1 ? interval
+                                        : interval_ms_ * 0.9 + interval * 0.1;
+    }
+    decode_ms_ =
+        speed_frames_ == 0 ? decode_ms : decode_ms_ * 0.9 + decode_ms * 0.1;
+    last_start_ = start;
+    speed_frames_++;
+    if (!auto_speed_ || speed_frames_ < 10)
+      return;
+    int64_t held_ms = util::elapsed_ms(speed_changed_);
+    int level = speed_level_;
+    if (decode_ms_ > interval_ms_ * 0.8 &&
+        level + 1 < util_decode::speed_levels() && held_ms >= 1000) {
+      level++;
+    } else if (decode_ms_ < interval_ms_ * 0.3 && level > 0 &&
+               held_ms >= 10000) {
+      level--;
+    }
+    if (level == speed_level_)
+      return;
+    LOG_INFO("decode speed level " + std::to_string(speed_level_) + " -> " +
+             std::to_string(level) + ", decode " +
+             std::to_string((int)decode_ms_) + "ms of " +
+             std::to_string((int)interval_ms_) + "ms, name: " + name_);
+    speed_level_ = level;
+    apply_speed();
+    speed_frames_ = 0;
+    speed_changed_ = now;
   }
 
   bool check_support() {
@@ -324,3 +597,67 @@ extern "C" int ffmpeg_ram_decode(FFmpegRamDecoder *decoder, const uint8_t *data,
   }
   return HWCODEC_ERR_COMMON;
 }
+
+extern "C" int ffmpeg_ram_set_decode_speed(FFmpegRamDecoder *decoder,
+                                           int level) {
+  try {
+    decoder->set_speed(level);
+    return 0;
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_set_decode_speed failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_set_preview(FFmpegRamDecoder *decoder,
+                                      int keyframe_only, int shift) {
+  try {
+    return decoder->set_preview(keyframe_only != 0, shift);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_set_preview failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_get_decode_speed(FFmpegRamDecoder *decoder) {
+  return decoder->speed_level_;
+}
+
+extern "C" int ffmpeg_ram_decode_latest(FFmpegRamDecoder *decoder,
+                                        const uint8_t *data, int length,
+                                        AVFrame **frame) {
+  try {
+    int ret = decoder->decode_latest(data, length, frame);
+    if (DataFormat::H265 == decoder->data_format_ &&
+        util_decode::has_flag_could_not_find_ref_with_poc()) {
+      return HWCODEC_ERR_HEVC_COULD_NOT_FIND_POC;
+    } else {
+      return ret == 0 ? HWCODEC_SUCCESS : HWCODEC_ERR_COMMON;
+    }
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_decode_latest exception:" + e.what());
+  }
+  return HWCODEC_ERR_COMMON;
+}
+
+extern "C" void ffmpeg_ram_frame_info(const AVFrame *frame, int *width,
+                                      int *height, int *pixfmt, int *linesize,
+                                      uint8_t **data, int *key) {
+  *width = frame->width;
+  *height = frame->height;
+  *pixfmt = frame->format;
+  for (int i = 0; i < AV_NUM_DATA_POINTERS; i++) {
+    linesize[i] = frame->linesize[i];
+    data[i] = frame->data[i];
+  }
+#if FF_API_FRAME_KEY
+  *key = (frame->flags & AV_FRAME_FLAG_KEY) ? 1 : 0;
+#else
+  *key = frame->key_frame;
+#endif
+}
+
+extern "C" void ffmpeg_ram_free_frame(AVFrame *frame) {
+  if (frame)
+    av_frame_free(&frame);
+}
@@ -7,15 +7,18 @@ extern "C" {
 #include <libavutil/opt.h>
 }
 
+#include <algorithm>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <vector>
 
 #include "common.h"
 
 #define LOG_MODULE "FFMPEG_RAM_ENC"
 #include <log.h>
+#include <simd.h>
 #include <util.h>
 #ifdef _WIN32
 #include "win.h"
@@ -90,14 +93,53 @@ _exit:
   return ret;
 }
 
+extern "C" int ffmpeg_ram_downscale_2x(int pix_fmt, int width, int height,
+                                       const uint8_t *src,
+                                       const int *src_linesize,
+                                       const int *src_offset, uint8_t *dst,
+                                       const int *dst_linesize,
+                                       const int *dst_offset) {
+  const uint8_t *src_data[3] = {src, src + src_offset[0], src + src_offset[1]};
+  uint8_t *dst_data[3] = {dst, dst + dst_offset[0], dst + dst_offset[1]};
+  if (!util_simd::downscale_frame_2x(pix_fmt, src_data, src_linesize, dst_data,
+                                     dst_linesize, width / 2, height / 2)) {
+    LOG_ERROR("downscale: unsupported pixfmt " + std::to_string(pix_fmt));
+    return -1;
+  }
+  return 0;
+}
+
 namespace {
 typedef void (*RamEncodeCallback)(const uint8_t *data, int len, int64_t pts,
-                                  int key, const void *obj);
+                                  int key, int layer, const void *obj);
+typedef struct RamEncodeRect {
+  int x;
+  int y;
+  int width;
+  int height;
+  int qoffset;
+} RamEncodeRect;
+typedef struct RamEncodeStats {
+  int64_t frames;
+  int64_t key_frames;
+  int64_t bytes;
+  int max_frame_size;
+  int frame_cap;
+  int64_t cap_hits;
+  int64_t cap_overs;
+  int speed_level;
+  int encode_us;
+  int64_t scene_changes;
+  int64_t scene_change_bytes;
+  int scene_score;
+} RamEncodeStats;
 
 class FFmpegRamEncoder {
 public:
+  const AVCodec *codec_ = NULL;
   AVCodecContext *c_ = NULL;
   AVFrame *frame_ = NULL;
+  AVFrame *scaled_frame_ = NULL; // only while scaling
   AVPacket *pkt_ = NULL;
   std::string name_;
   std::string mc_name_; // for mediacodec
@@ -114,17 +156,54 @@ public:
   int gop_ = 0xFFFF;
   int thread_count_ = 1;
   int gpu_ = 0;
+  int static_keepalive_ms_ = 0;
+  int intra_refresh_ = 0;
+  int max_frame_bytes_ = 0;
+  int max_frame_ms_ = 0;
+  int scene_change_ = 0;
+  int scene_change_hold_ms_ = 0;
+  int temporal_layers_ = 1;
+  // encoded size over input size, see set_scale
+  int scale_num_ = 1;
+  int scale_den_ = 1;
   RamEncodeCallback callback_ = NULL;
   int offset_[AV_NUM_DATA_POINTERS] = {0};
 
+  std::vector<uint64_t> tile_hashes_;
+  std::vector<uint64_t> last_tile_hashes_;
+  bool last_encoded_ = false;
+  std::chrono::steady_clock::time_point last_encode_time_;
+  bool keyframe_requested_ = false;
+  int gop_frames_ = 0; // frames since and including the last keyframe
+  // since open or the last forced keyframe, drives the temporal layer pattern
+  int64_t sent_frames_ = 0;
+  RamEncodeStats stats_ = {};
+  int speed_level_ = 0;
+  int speed_frames_ = 0; // frames since the last speed change
+  double encode_ms_ = 0;
+  // a speed change is wanted, but waits for a keyframe
+  bool speed_pending_ = false;
+  std::chrono::steady_clock::time_point speed_pending_since_;
+  std::vector<uint8_t> block_means_;
+  std::vector<uint8_t> last_block_means_;
+  bool scene_armed_ = true;
+  bool scene_keyframe_ = false;
+  std::chrono::steady_clock::time_point last_scene_change_time_;
+
   AVHWDeviceType hw_device_type_ = AV_HWDEVICE_TYPE_NONE;
   AVPixelFormat hw_pixfmt_ = AV_PIX_FMT_NONE;
   AVBufferRef *hw_device_ctx_ = NULL;
+  AVBufferRef *hw_frames_ctx_ = NULL;
   AVFrame *hw_frame_ = NULL;
+  bool hw_frame_uploaded_ = false;
+  bool hw_partial_upload_ = true;
 
   FFmpegRamEncoder(const char *name, const char *mc_name, int width, int height,
                    int pixfmt, int align, int fps, int gop, int rc, int quality,
                    int kbs, int q, int thread_count, int gpu,
+                   int static_keepalive_ms, int intra_refresh,
+                   int max_frame_bytes, int max_frame_ms, int scene_change,
+                   int scene_change_hold_ms, int temporal_layers,
                    RamEncodeCallback callback) {
     name_ = name;
     mc_name_ = mc_name ? mc_name : "";
@@ -140,6 +219,13 @@ public:
     q_ = q;
     thread_count_ = thread_count;
     gpu_ = gpu;
+    static_keepalive_ms_ = static_keepalive_ms;
+    intra_refresh_ = intra_refresh;
+    max_frame_bytes_ = max_frame_bytes;
+    max_frame_ms_ = max_frame_ms;
+    scene_change_ = scene_change;
+    scene_change_hold_ms_ = scene_change_hold_ms;
+    temporal_layers_ = std::max(1, std::min(temporal_layers, 3));
     callback_ = callback;
     if (name_.find("vaapi") != std::string::npos) {
       hw_device_type_ = AV_HWDEVICE_TYPE_VAAPI;
@@ -155,20 +241,13 @@ public:
   ~FFmpegRamEncoder() {}
 
   bool init(int *linesize, int *offset, int *length) {
-    const AVCodec *codec = NULL;
-
     int ret;
 
-    if (!(codec = avcodec_find_encoder_by_name(name_.c_str()))) {
+    if (!(codec_ = avcodec_find_encoder_by_name(name_.c_str()))) {
       LOG_ERROR("Codec " + name_ + " not found");
       return false;
     }
 
-    if (!(c_ = avcodec_alloc_context3(codec))) {
-      LOG_ERROR("Could not allocate video codec context");
-      return false;
-    }
-
     if (hw_device_type_ != AV_HWDEVICE_TYPE_NONE) {
       std::string device = "";
 #ifdef _WIN32
@@ -187,25 +266,252 @@ public:
         LOG_ERROR("av_hwdevice_ctx_create failed");
         return false;
       }
-      if (set_hwframe_ctx() != 0) {
-        LOG_ERROR("set_hwframe_ctx failed");
-        return false;
-      }
-      hw_frame_ = av_frame_alloc();
-      if (!hw_frame_) {
-        LOG_ERROR("av_frame_alloc failed");
-        return false;
-      }
-      if ((ret = av_hwframe_get_buffer(c_->hw_frames_ctx, hw_frame_, 0)) < 0) {
-        LOG_ERROR("av_hwframe_get_buffer failed, ret = " + av_err2str(ret));
-        return false;
-      }
-      if (!hw_frame_->hw_frames_ctx) {
-        LOG_ERROR("hw_frame_->hw_frames_ctx is NULL");
+      if (!alloc_hw_frame())
         return false;
+    }
+
+    if (!(pkt_ = av_packet_alloc())) {
+      LOG_ERROR("Could not allocate video packet");
+      return false;
+    }
+
+    if (!alloc_frame(linesize, offset, length))
+      return false;
+    if (!open_codec())
+      return false;
+    if (quality_ == Quality_Auto && util_encode::speed_levels(name_) == 0)
+      LOG_WARN("Quality_Auto not supported, name: " + name_);
+    return true;
+  }
+
+  // rect_count < 0 means no dirty information, anything may have changed
+  int encode(const uint8_t *data, int length, const void *obj, uint64_t ms,
+             const RamEncodeRect *rects = NULL, int rect_count = -1) {
+    int ret;
+
+    if (!c_) {
+      LOG_ERROR("encoder is closed after a failed reopen, name: " + name_);
+      return -1;
+    }
+    if ((ret = av_frame_make_writable(frame_)) != 0) {
+      LOG_ERROR("av_frame_make_writable failed, ret = " + av_err2str(ret));
+      return ret;
+    }
+    if ((ret = fill_frame(frame_, (uint8_t *)data, length, offset_)) != 0)
+      return ret;
+    if (skip_static_frame(rect_count))
+      return 0;
+    detect_scene_change();
+    adapt_speed();
+    if (!c_)
+      return -1; // the reopen and the restore both failed
+    AVFrame *src_frame = frame_;
+    if (scaled_frame_) {
+      if ((ret = scale(frame_, scaled_frame_)) < 0)
+        return ret;
+      src_frame = scaled_frame_;
+    }
+    AVFrame *tmp_frame;
+    if (hw_device_type_ != AV_HWDEVICE_TYPE_NONE) {
+      if ((ret = upload(src_frame, rects, rect_count)) < 0)
+        return ret;
+      tmp_frame = hw_frame_;
+    } else {
+      tmp_frame = src_frame;
+    }
+    if ((ret = set_roi(tmp_frame, rects, rect_count)) < 0)
+      return ret;
+
+    auto start = util::now();
+    ret = do_encode(tmp_frame, obj, ms);
+    av_frame_remove_side_data(tmp_frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+    if (ret == 0) {
+      double encode_ms =
+          std::chrono::duration<double, std::milli>(util::now() - start)
+              .count();
+      encode_ms_ = stats_.frames <= 1 ? encode_ms
+                                      : encode_ms_ * 0.9 + encode_ms * 0.1;
+      speed_frames_++;
+      last_encoded_ = true;
+      last_encode_time_ = util::now();
+      if (rect_count < 0) {
+        tile_hashes_.swap(last_tile_hashes_);
+      } else {
+        // not hashed, the next hashed frame must not match stale hashes
+        last_tile_hashes_.clear();
       }
     }
+    return ret;
+  }
+
+  void free_encoder() {
+    if (pkt_)
+      av_packet_free(&pkt_);
+    if (frame_)
+      av_frame_free(&frame_);
+    if (scaled_frame_)
+      av_frame_free(&scaled_frame_);
+    if (hw_frame_)
+      av_frame_free(&hw_frame_);
+    if (c_)
+      avcodec_free_context(&c_);
+    if (hw_frames_ctx_)
+      av_buffer_unref(&hw_frames_ctx_);
+    if (hw_device_ctx_)
+      av_buffer_unref(&hw_device_ctx_);
+  }
+
+  // Encoders that only read the bitrate on open are reopened, which restarts
+  // with a keyframe, so callers should not change it every frame.
+  int set_bitrate(int kbs) {
+    if (!c_ || kbs <= 0)
+      return -1;
+    if (kbs == kbs_)
+      return 0;
+    if (util_encode::change_bit_rate(c_, name_, kbs)) {
+      kbs_ = kbs;
+      util_encode::set_frame_cap(c_, name_, frame_cap());
+      return 0;
+    }
+    return reopen(kbs_, kbs);
+  }
 
+  // No backend re-reads the framerate after open, libx264 copies it into its
+  // params once, so a change always reopens.
+  int set_framerate(int fps) {
+    if (!c_ || fps <= 0)
+      return -1;
+    if (fps == fps_)
+      return 0;
+    return reopen(fps_, fps);
+  }
+
+  // A shorter GOP than the one the encoder was opened with is applied in place
+  // by forcing the keyframes from here. A longer or infinite GOP needs a
+  // reopen, as does any change with intra refresh, whose period is the GOP.
+  int set_gop(int gop) {
+    if (!c_)
+      return -1;
+    if (gop == gop_)
+      return 0;
+    if (intra_refresh_ <= 0 && gop > 0 && gop <= c_->gop_size) {
+      gop_ = gop;
+      return 0;
+    }
+    return reopen(gop_, gop);
+  }
+
+  // Switches the input size without a new encoder. The codec lookup and the
+  // hw device are kept, the hw frames too if the encoded size is unchanged;
+  // the frame buffers and the codec context are rebuilt. The new layout of
+  // the input is returned like from ffmpeg_ram_new_encoder.
+  int reconfigure(int width, int height, int *linesize, int *offset,
+                  int *length) {
+    if (width <= 0 || height <= 0 || width % 2 || height % 2) {
+      LOG_ERROR("invalid size " + std::to_string(width) + "x" +
+                std::to_string(height));
+      return -1;
+    }
+    if (c_ && width == width_ && height == height_)
+      return 0;
+    int old_width = width_;
+    int old_height = height_;
+    width_ = width;
+    height_ = height;
+    if (alloc_frame(linesize, offset, length) && resize())
+      return 0;
+    LOG_WARN("reconfigure failed, restore previous size, name: " + name_);
+    width_ = old_width;
+    height_ = old_height;
+    int ignored[AV_NUM_DATA_POINTERS];
+    int ignored_length;
+    if (!alloc_frame(ignored, ignored, &ignored_length) || !resize()) {
+      LOG_ERROR("reconfigure with previous size failed, name: " + name_);
+      if (c_)
+        avcodec_free_context(&c_);
+    }
+    return -1;
+  }
+
+  // Encodes at num/den of the input size, 1/1, 3/4 or 1/2, downscaled here
+  // from the caller's buffer, whose layout stays the same. The codec is
+  // reopened at the new size on the same hw device, starting with a keyframe.
+  int set_scale(int num, int den) {
+    if (!c_)
+      return -1;
+    if (!((num == 1 && den == 1) || (num == 3 && den == 4) ||
+          (num == 1 && den == 2))) {
+      LOG_ERROR("unsupported scale " + std::to_string(num) + "/" +
+                std::to_string(den));
+      return -1;
+    }
+    if (num == scale_num_ && den == scale_den_)
+      return 0;
+    int old_num = scale_num_;
+    int old_den = scale_den_;
+    scale_num_ = num;
+    scale_den_ = den;
+    if (resize())
+      return 0;
+    LOG_WARN("rescale failed, restore previous scale, name: " + name_);
+    scale_num_ = old_num;
+    scale_den_ = old_den;
+    if (!resize()) {
+      LOG_ERROR("rescale with previous scale failed, name: " + name_);
+      if (c_)
+        avcodec_free_context(&c_);
+    }
+    return -1;
+  }
+
+  // the next encoded frame is forced to an IDR
+  int request_keyframe() {
+    keyframe_requested_ = true;
+    return 0;
+  }
+
+  int get_stats(RamEncodeStats *stats) {
+    *stats = stats_;
+    stats->frame_cap = frame_cap();
+    stats->speed_level = quality_ == Quality_Auto ? speed_level_ : -1;
+    stats->encode_us = (int)(encode_ms_ * 1000);
+    return 0;
+  }
+
+private:
+  // the size the codec is opened with, even
+  int enc_width() const { return width_ * scale_num_ / scale_den_ & ~1; }
+  int enc_height() const { return height_ * scale_num_ / scale_den_ & ~1; }
+
+  bool alloc_hw_frame() {
+    int ret;
+    if (set_hwframe_ctx() != 0) {
+      LOG_ERROR("set_hwframe_ctx failed");
+      return false;
+    }
+    hw_frame_ = av_frame_alloc();
+    if (!hw_frame_) {
+      LOG_ERROR("av_frame_alloc failed");
+      return false;
+    }
+    if ((ret = av_hwframe_get_buffer(hw_frames_ctx_, hw_frame_, 0)) < 0) {
+      LOG_ERROR("av_hwframe_get_buffer failed, ret = " + av_err2str(ret));
+      return false;
+    }
+    if (!hw_frame_->hw_frames_ctx) {
+      LOG_ERROR("hw_frame_->hw_frames_ctx is NULL");
+      return false;
+    }
+    hw_frame_uploaded_ = false;
+    return true;
+  }
+
+  // The input frame, its layout and the state computed on input pictures,
+  // which is meaningless at another size.
+  bool alloc_frame(int *linesize, int *offset, int *length) {
+    int ret;
+    if (frame_)
+      av_frame_free(&frame_);
     if (!(frame_ = av_frame_alloc())) {
       LOG_ERROR("Could not allocate video frame");
       return false;
@@ -218,15 +524,94 @@ public:
       LOG_ERROR("av_frame_get_buffer failed, ret = " + av_err2str(ret));
       return false;
     }
+    memset(offset_, 0, sizeof(offset_));
+    if (ffmpeg_ram_get_linesize_offset_length(pixfmt_, width_, height_, align_,
+                                              NULL, offset_, length) != 0)
+      return false;
 
-    if (!(pkt_ = av_packet_alloc())) {
-      LOG_ERROR("Could not allocate video packet");
+    for (int i = 0; i < AV_NUM_DATA_POINTERS; i++) {
+      linesize[i] = frame_->linesize[i];
+      offset[i] = offset_[i];
+    }
+    last_tile_hashes_.clear();
+    last_block_means_.clear();
+    last_encoded_ = false;
+    return true;
+  }
+
+  // Reallocates what depends on the encoded size and reopens the codec. The
+  // hw device is kept, the hw frames are only recreated if the size changed.
+  bool resize() {
+    int ret;
+    if (scaled_frame_)
+      av_frame_free(&scaled_frame_);
+    if (enc_width() != width_ || enc_height() != height_) {
+      if (!(scaled_frame_ = av_frame_alloc())) {
+        LOG_ERROR("av_frame_alloc failed");
+        return false;
+      }
+      scaled_frame_->format = pixfmt_;
+      scaled_frame_->width = enc_width();
+      scaled_frame_->height = enc_height();
+      if ((ret = av_frame_get_buffer(scaled_frame_, align_)) < 0) {
+        LOG_ERROR("av_frame_get_buffer failed, ret = " + av_err2str(ret));
+        return false;
+      }
+    }
+    if (hw_frames_ctx_) {
+      AVHWFramesContext *frames_ctx =
+          (AVHWFramesContext *)hw_frames_ctx_->data;
+      if (frames_ctx->width != enc_width() ||
+          frames_ctx->height != enc_height()) {
+        if (c_)
+          avcodec_free_context(&c_); // holds a reference
+        av_frame_free(&hw_frame_);
+        av_buffer_unref(&hw_frames_ctx_);
+        if (!alloc_hw_frame())
+          return false;
+      }
+    }
+    return open_codec();
+  }
+
+  int scale(AVFrame *src, AVFrame *dst) {
+    int ret;
+    if ((ret = av_frame_make_writable(dst)) != 0) {
+      LOG_ERROR("av_frame_make_writable failed, ret = " + av_err2str(ret));
+      return ret;
+    }
+    if (!util_simd::downscale_frame(src->format, src->data, src->linesize,
+                                    src->width, src->height, dst->data,
+                                    dst->linesize, dst->width, dst->height,
+                                    scale_num_, scale_den_)) {
+      LOG_ERROR("downscale failed, pixfmt: " + std::to_string(src->format));
+      return -1;
+    }
+    return 0;
+  }
+
+  // Only the codec context is rebuilt on reopen, the hw device, hw frames and
+  // frame buffers are kept. Nothing is lost in flight, the encoder runs
+  // without b-frames or lookahead and every frame is drained on encode.
+  bool open_codec() {
+    int ret;
+
+    if (c_)
+      avcodec_free_context(&c_);
+    if (!(c_ = avcodec_alloc_context3(codec_))) {
+      LOG_ERROR("Could not allocate video codec context");
       return false;
     }
+    if (hw_frames_ctx_) {
+      if (!(c_->hw_frames_ctx = av_buffer_ref(hw_frames_ctx_))) {
+        LOG_ERROR("av_buffer_ref failed");
+        return false;
+      }
+    }
 
     /* resolution must be a multiple of two */
-    c_->width = width_;
-    c_->height = height_;
+    c_->width = enc_width();
+    c_->height = enc_height();
     c_->pix_fmt =
         hw_pixfmt_ != AV_PIX_FMT_NONE ? hw_pixfmt_ : (AVPixelFormat)pixfmt_;
     c_->sw_pix_fmt = (AVPixelFormat)pixfmt_;
@@ -236,10 +621,19 @@ public:
       return false;
     }
     // util_encode::set_quality(c_->priv_data, name_, quality_);
+    if (quality_ == Quality_Auto)
+      util_encode::set_speed(c_->priv_data, name_, speed_level_);
     util_encode::set_rate_control(c_, name_, rc_, q_);
+    util_encode::set_frame_cap(c_, name_, frame_cap());
     util_encode::set_gpu(c_->priv_data, name_, gpu_);
     util_encode::force_hw(c_->priv_data, name_);
     util_encode::set_others(c_->priv_data, name_);
+    if (!util_encode::set_intra_refresh(c_, name_, intra_refresh_)) {
+      LOG_ERROR("set_intra_refresh failed, name: " + name_);
+      return false;
+    }
+    if (!util_encode::set_temporal_layers(c_, name_, temporal_layers_))
+      temporal_layers_ = 1;
     if (name_.find("mediacodec") != std::string::npos) {
       if (mc_name_.length() > 0) {
         LOG_INFO("mediacodec codec_name: " + mc_name_);
@@ -250,64 +644,146 @@ public:
       }
     }
 
-    if ((ret = avcodec_open2(c_, codec, NULL)) < 0) {
+    if ((ret = avcodec_open2(c_, codec_, NULL)) < 0) {
       LOG_ERROR("avcodec_open2 failed, ret = " + av_err2str(ret) +
                 ", name: " + name_);
       return false;
     }
-
-    if (ffmpeg_ram_get_linesize_offset_length(pixfmt_, width_, height_, align_,
-                                              NULL, offset_, length) != 0)
-      return false;
-
-    for (int i = 0; i < AV_NUM_DATA_POINTERS; i++) {
-      linesize[i] = frame_->linesize[i];
-      offset[i] = offset_[i];
-    }
+    gop_frames_ = 0;
+    sent_frames_ = 0;
     return true;
   }
 
-  int encode(const uint8_t *data, int length, const void *obj, uint64_t ms) {
-    int ret;
+  // Sets param to value and reopens. If the encoder refuses the new value the
+  // old one is restored, so a failed change leaves a working encoder.
+  int reopen(int &param, int value) {
+    int old = param;
+    param = value;
+    if (open_codec())
+      return 0;
+    LOG_WARN("reopen failed, restore previous parameters, name: " + name_);
+    param = old;
+    if (!open_codec()) {
+      LOG_ERROR("reopen with previous parameters failed, name: " + name_);
+      if (c_)
+        avcodec_free_context(&c_);
+    }
+    return -1;
+  }
 
-    if ((ret = av_frame_make_writable(frame_)) != 0) {
-      LOG_ERROR("av_frame_make_writable failed, ret = " + av_err2str(ret));
-      return ret;
+  // bytes, the smaller of the two limits, 0 without a cap. The link time cap
+  // follows the bitrate.
+  int frame_cap() const {
+    int64_t cap = max_frame_bytes_ > 0 ? max_frame_bytes_ : 0;
+    if (max_frame_ms_ > 0 && kbs_ > 0) {
+      // kbit per second * ms / 8 is bytes
+      int64_t bytes = (int64_t)kbs_ * max_frame_ms_ / 8;
+      cap = cap > 0 ? std::min(cap, bytes) : bytes;
     }
-    if ((ret = fill_frame(frame_, (uint8_t *)data, length, offset_)) != 0)
-      return ret;
-    AVFrame *tmp_frame;
-    if (hw_device_type_ != AV_HWDEVICE_TYPE_NONE) {
-      if ((ret = av_hwframe_transfer_data(hw_frame_, frame_, 0)) < 0) {
-        LOG_ERROR("av_hwframe_transfer_data failed, ret = " + av_err2str(ret));
-        return ret;
+    return (int)std::min(cap, (int64_t)INT32_MAX);
+  }
+
+  // A wholesale content change is coded as an IDR instead of a huge P-frame.
+  // The score is the percentage of 8x8 luma blocks whose mean moved since the
+  // last encoded frame. After a trigger the detector re-arms once the score
+  // is below half the threshold and scene_change_hold_ms has passed.
+  void detect_scene_change() {
+    const int block_diff = 12;
+    if (scene_change_ <= 0)
+      return;
+    util_simd::block_means(frame_->data[0], frame_->linesize[0], width_,
+                           height_, block_means_);
+    int score = 0;
+    if (!block_means_.empty() &&
+        block_means_.size() == last_block_means_.size()) {
+      size_t changed = 0;
+      for (size_t i = 0; i < block_means_.size(); i++) {
+        if (std::abs(block_means_[i] - last_block_means_[i]) > block_diff)
+          changed++;
       }
-      tmp_frame = hw_frame_;
-    } else {
-      tmp_frame = frame_;
+      score = (int)(changed * 100 / block_means_.size());
     }
+    block_means_.swap(last_block_means_);
+    stats_.scene_score = score;
+    if (!scene_armed_) {
+      scene_armed_ = score * 2 < scene_change_ &&
+                     util::elapsed_ms(last_scene_change_time_) >=
+                         scene_change_hold_ms_;
+      return;
+    }
+    if (score >= scene_change_) {
+      scene_armed_ = false;
+      last_scene_change_time_ = util::now();
+      stats_.scene_changes++;
+      if (!keyframe_requested_)
+        scene_keyframe_ = true;
+      keyframe_requested_ = true;
+    }
+  }
 
-    return do_encode(tmp_frame, obj, ms);
+  // the next frame becomes a keyframe anyway
+  bool keyframe_due() const {
+    if (keyframe_requested_)
+      return true;
+    if (intra_refresh_ > 0)
+      return false;
+    int gop = gop_ > 0 && gop_ < c_->gop_size ? gop_ : c_->gop_size;
+    return gop_frames_ >= gop;
   }
 
-  void free_encoder() {
-    if (pkt_)
-      av_packet_free(&pkt_);
-    if (frame_)
-      av_frame_free(&frame_);
-    if (hw_frame_)
-      av_frame_free(&hw_frame_);
-    if (hw_device_ctx_)
-      av_buffer_unref(&hw_device_ctx_);
-    if (c_)
-      avcodec_free_context(&c_);
+  // Quality_Auto steps the preset by the encode time against the frame
+  // budget. A preset change needs a reopen, so it waits for a keyframe that
+  // is due anyway, unless the encoder can't keep up at all. Without one, e.g.
+  // with an infinite gop, a step is forced once it has been pending for 5s,
+  // 20s when going back to a slower preset. That also needs a long quiet
+  // period first to avoid oscillating.
+  void adapt_speed() {
+    if (quality_ != Quality_Auto || speed_frames_ < fps_)
+      return;
+    double budget = 1000.0 / std::max(fps_, 1);
+    int level = speed_level_;
+    if (encode_ms_ > budget * 0.8 &&
+        level + 1 < util_encode::speed_levels(name_)) {
+      level++;
+    } else if (encode_ms_ < budget * 0.3 && level > 0 &&
+               speed_frames_ >= 10 * fps_) {
+      level--;
+    }
+    if (level == speed_level_) {
+      speed_pending_ = false;
+      return;
+    }
+    if (!speed_pending_) {
+      speed_pending_ = true;
+      speed_pending_since_ = util::now();
+    }
+    bool behind =
+        level > speed_level_ && encode_ms_ > budget && speed_frames_ >= 2 * fps_;
+    int64_t max_wait_ms = level > speed_level_ ? 5000 : 20000;
+    if (!keyframe_due() && !behind &&
+        util::elapsed_ms(speed_pending_since_) < max_wait_ms)
+      return;
+    LOG_INFO("speed level " + std::to_string(speed_level_) + " -> " +
+             std::to_string(level) + ", encode " +
+             std::to_string((int)encode_ms_) + "ms, name: " + name_);
+    reopen(speed_level_, level);
+    speed_frames_ = 0;
+    speed_pending_ = false;
   }
 
-  int set_bitrate(int kbs) {
-    return util_encode::change_bit_rate(c_, name_, kbs) ? 0 : -1;
+  void update_stats(int size, bool key) {
+    int cap = frame_cap();
+    stats_.frames++;
+    stats_.bytes += size;
+    if (key)
+      stats_.key_frames++;
+    stats_.max_frame_size = std::max(stats_.max_frame_size, size);
+    if (cap > 0 && (int64_t)size * 10 >= (int64_t)cap * 9)
+      stats_.cap_hits++;
+    if (cap > 0 && size > cap)
+      stats_.cap_overs++;
   }
 
-private:
   int set_hwframe_ctx() {
     AVBufferRef *hw_frames_ref;
     AVHWFramesContext *frames_ctx = NULL;
@@ -320,30 +796,193 @@ private:
     frames_ctx = (AVHWFramesContext *)(hw_frames_ref->data);
     frames_ctx->format = hw_pixfmt_;
     frames_ctx->sw_format = (AVPixelFormat)pixfmt_;
-    frames_ctx->width = width_;
-    frames_ctx->height = height_;
+    frames_ctx->width = enc_width();
+    frames_ctx->height = enc_height();
     frames_ctx->initial_pool_size = 1;
     if ((err = av_hwframe_ctx_init(hw_frames_ref)) < 0) {
       av_buffer_unref(&hw_frames_ref);
       return err;
     }
-    c_->hw_frames_ctx = av_buffer_ref(hw_frames_ref);
-    if (!c_->hw_frames_ctx) {
-      LOG_ERROR("av_buffer_ref failed");
-      err = -1;
+    hw_frames_ctx_ = hw_frames_ref;
+    return 0;
+  }
+
+  // Unchanged input within the keepalive interval is not encoded at all, the
+  // caller gets no packet. After the interval the same picture is encoded
+  // again, which costs a tiny P-frame. Dirty rects replace the hashing.
+  bool skip_static_frame(int rect_count) {
+    if (static_keepalive_ms_ <= 0)
+      return false;
+    bool unchanged;
+    if (rect_count >= 0) {
+      unchanged = rect_count == 0;
+    } else {
+      if (!util_simd::hash_frame_tiles(frame_->format, frame_->data,
+                                       frame_->linesize, width_, height_,
+                                       tile_hashes_))
+        return false;
+      unchanged = tile_hashes_ == last_tile_hashes_;
     }
-    av_buffer_unref(&hw_frames_ref);
-    return err;
+    return !keyframe_requested_ && last_encoded_ && unchanged &&
+           util::elapsed_ms(last_encode_time_) < static_keepalive_ms_;
+  }
+
+  // clip to the frame, expanded to even coordinates for the chroma planes.
+  // An end at the frame edge stays there, odd or not, rounding it down would
+  // lose the last column or row. The end is summed in 64 bits, the rects come
+  // from the caller.
+  bool clip_rect(const RamEncodeRect &rect, int &x0, int &y0, int &x1,
+                 int &y1) {
+    x0 = std::max(rect.x, 0) & ~1;
+    y0 = std::max(rect.y, 0) & ~1;
+    int64_t x_end = ((int64_t)rect.x + rect.width + 1) & ~(int64_t)1;
+    int64_t y_end = ((int64_t)rect.y + rect.height + 1) & ~(int64_t)1;
+    x1 = (int)std::min(x_end, (int64_t)width_);
+    y1 = (int)std::min(y_end, (int64_t)height_);
+    return x1 > x0 && y1 > y0;
+  }
+
+  // The hw surface is reused for every frame, so once it holds a full
+  // picture only the dirty rects need uploading. Limited to vaapi, where
+  // mapping for write is direct; d3d11 maps through a staging copy of the
+  // whole texture, which costs more than a full upload. A scaled picture is
+  // always uploaded whole, the rects are in input coordinates.
+  int upload(AVFrame *src, const RamEncodeRect *rects, int rect_count) {
+    int ret;
+    if (hw_device_type_ == AV_HWDEVICE_TYPE_VAAPI && hw_partial_upload_ &&
+        hw_frame_uploaded_ && rect_count >= 0 && src == frame_) {
+      int64_t area = 0;
+      int x0, y0, x1, y1;
+      for (int i = 0; i < rect_count; i++) {
+        if (clip_rect(rects[i], x0, y0, x1, y1))
+          area += (int64_t)(x1 - x0) * (y1 - y0);
+      }
+      if (area * 2 < (int64_t)width_ * height_ &&
+          upload_rects(rects, rect_count) == 0)
+        return 0;
+    }
+    if ((ret = av_hwframe_transfer_data(hw_frame_, src, 0)) < 0) {
+      LOG_ERROR("av_hwframe_transfer_data failed, ret = " + av_err2str(ret));
+      hw_frame_uploaded_ = false;
+      return ret;
+    }
+    hw_frame_uploaded_ = true;
+    return 0;
+  }
+
+  int upload_rects(const RamEncodeRect *rects, int rect_count) {
+    AVFrame *mapped = av_frame_alloc();
+    int ret;
+    if (!mapped) {
+      LOG_ERROR("av_frame_alloc failed");
+      return -1;
+    }
+    mapped->format = pixfmt_;
+    if ((ret = av_hwframe_map(mapped, hw_frame_, AV_HWFRAME_MAP_WRITE)) < 0) {
+      LOG_WARN("av_hwframe_map failed, fall back to full upload, ret = " +
+               av_err2str(ret));
+      hw_partial_upload_ = false;
+      av_frame_free(&mapped);
+      return ret;
+    }
+    int x0, y0, x1, y1;
+    for (int i = 0; i < rect_count; i++) {
+      if (!clip_rect(rects[i], x0, y0, x1, y1))
+        continue;
+      av_image_copy_plane(
+          mapped->data[0] + y0 * mapped->linesize[0] + x0, mapped->linesize[0],
+          frame_->data[0] + y0 * frame_->linesize[0] + x0, frame_->linesize[0],
+          x1 - x0, y1 - y0);
+      if (pixfmt_ == AV_PIX_FMT_NV12) {
+        av_image_copy_plane(
+            mapped->data[1] + y0 / 2 * mapped->linesize[1] + x0,
+            mapped->linesize[1],
+            frame_->data[1] + y0 / 2 * frame_->linesize[1] + x0,
+            frame_->linesize[1], (x1 - x0 + 1) & ~1, (y1 - y0 + 1) / 2);
+      } else {
+        for (int p = 1; p < 3; p++) {
+          av_image_copy_plane(
+              mapped->data[p] + y0 / 2 * mapped->linesize[p] + x0 / 2,
+              mapped->linesize[p],
+              frame_->data[p] + y0 / 2 * frame_->linesize[p] + x0 / 2,
+              frame_->linesize[p], (x1 - x0 + 1) / 2, (y1 - y0 + 1) / 2);
+        }
+      }
+    }
+    av_frame_free(&mapped);
+    return 0;
+  }
+
+  // qoffset in [-100, 100] percent, negative for better quality. Encoders
+  // without roi support ignore the side data.
+  int set_roi(AVFrame *frame, const RamEncodeRect *rects, int rect_count) {
+    int count = 0;
+    int x0, y0, x1, y1;
+    for (int i = 0; i < rect_count; i++) {
+      if (rects[i].qoffset != 0 && clip_rect(rects[i], x0, y0, x1, y1))
+        count++;
+    }
+    if (count == 0)
+      return 0;
+    AVFrameSideData *sd = av_frame_new_side_data(
+        frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+        count * sizeof(AVRegionOfInterest));
+    if (!sd) {
+      LOG_ERROR("av_frame_new_side_data failed");
+      return AVERROR(ENOMEM);
+    }
+    AVRegionOfInterest *roi = (AVRegionOfInterest *)sd->data;
+    for (int i = 0; i < rect_count; i++) {
+      if (rects[i].qoffset == 0 || !clip_rect(rects[i], x0, y0, x1, y1))
+        continue;
+      roi->self_size = sizeof(AVRegionOfInterest);
+      roi->left = x0 * scale_num_ / scale_den_;
+      roi->top = y0 * scale_num_ / scale_den_;
+      roi->right = x1 * scale_num_ / scale_den_;
+      roi->bottom = y1 * scale_num_ / scale_den_;
+      roi->qoffset =
+          av_make_q(std::max(-100, std::min(rects[i].qoffset, 100)), 100);
+      roi++;
+    }
+    return 0;
+  }
+
+  // frame_ and hw_frame_ are reused, so the picture type is always reset
+  void set_keyframe(AVFrame *frame, bool key) {
+    frame->pict_type = key ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+#if FF_API_FRAME_KEY
+    if (key)
+      frame->flags |= AV_FRAME_FLAG_KEY;
+    else
+      frame->flags &= ~AV_FRAME_FLAG_KEY;
+#else
+    frame->key_frame = key ? 1 : 0;
+#endif
   }
 
   int do_encode(AVFrame *frame, const void *obj, int64_t ms) {
     int ret;
     bool encoded = false;
+    // gop_ below the opened gop_size was set in place, see set_gop
+    bool force_key = keyframe_requested_ ||
+                     (intra_refresh_ <= 0 && gop_ > 0 &&
+                      gop_ < c_->gop_size && gop_frames_ >= gop_);
     frame->pts = ms;
-    if ((ret = avcodec_send_frame(c_, frame)) < 0) {
+    set_keyframe(frame, force_key);
+    ret = avcodec_send_frame(c_, frame);
+    set_keyframe(frame, false);
+    if (ret < 0) {
       LOG_ERROR("avcodec_send_frame failed, ret = " + av_err2str(ret));
       return ret;
     }
+    keyframe_requested_ = false;
+    bool scene_change = scene_keyframe_;
+    scene_keyframe_ = false;
+    // libvpx restarts the layer pattern on a forced keyframe
+    if (force_key)
+      sent_frames_ = 0;
+    // no b-frames or lookahead, the packets come in frame order
+    int layer = util_encode::temporal_layer(temporal_layers_, sent_frames_++);
 
     auto start = util::now();
     while (ret >= 0 && util::elapsed_ms(start) < DECODE_TIMEOUT_MS) {
@@ -358,8 +997,16 @@ private:
         goto _exit;
       }
       encoded = true;
+      if (force_key && !(pkt_->flags & AV_PKT_FLAG_KEY)) {
+        LOG_WARN("keyframe requested but not produced, name: " + name_);
+      }
+      force_key = false;
+      gop_frames_ = (pkt_->flags & AV_PKT_FLAG_KEY) ? 1 : gop_frames_ + 1;
+      update_stats(pkt_->size, pkt_->flags & AV_PKT_FLAG_KEY);
+      if (scene_change)
+        stats_.scene_change_bytes += pkt_->size;
       callback_(pkt_->data, pkt_->size, pkt_->pts,
-                pkt_->flags & AV_PKT_FLAG_KEY, obj);
+                pkt_->flags & AV_PKT_FLAG_KEY, layer, obj);
     }
   _exit:
     av_packet_unref(pkt_);
@@ -411,13 +1058,18 @@ extern "C" FFmpegRamEncoder *
 ffmpeg_ram_new_encoder(const char *name, const char *mc_name, int width,
                        int height, int pixfmt, int align, int fps, int gop,
                        int rc, int quality, int kbs, int q, int thread_count,
-                       int gpu, int *linesize, int *offset, int *length,
-                       RamEncodeCallback callback) {
+                       int gpu, int static_keepalive_ms, int intra_refresh,
+                       int max_frame_bytes, int max_frame_ms,
+                       int scene_change, int scene_change_hold_ms,
+                       int temporal_layers, int *linesize, int *offset,
+                       int *length, RamEncodeCallback callback) {
   FFmpegRamEncoder *encoder = NULL;
   try {
-    encoder = new FFmpegRamEncoder(name, mc_name, width, height, pixfmt, align,
-                                   fps, gop, rc, quality, kbs, q, thread_count,
-                                   gpu, callback);
+    encoder = new FFmpegRamEncoder(
+        name, mc_name, width, height, pixfmt, align, fps, gop, rc, quality, kbs,
+        q, thread_count, gpu, static_keepalive_ms, intra_refresh,
+        max_frame_bytes, max_frame_ms, scene_change, scene_change_hold_ms,
+        temporal_layers, callback);
     if (encoder) {
       if (encoder->init(linesize, offset, length)) {
         return encoder;
@@ -444,6 +1096,60 @@ extern "C" int ffmpeg_ram_encode(FFmpegRamEncoder *encoder, const uint8_t *data,
   return -1;
 }
 
+extern "C" int ffmpeg_ram_encode_rects(FFmpegRamEncoder *encoder,
+                                       const uint8_t *data, int length,
+                                       const void *obj, uint64_t ms,
+                                       const RamEncodeRect *rects,
+                                       int rect_count) {
+  try {
+    return encoder->encode(data, length, obj, ms, rects,
+                           rects ? rect_count : -1);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_encode_rects failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_reconfigure(FFmpegRamEncoder *encoder, int width,
+                                      int height, int *linesize, int *offset,
+                                      int *length) {
+  try {
+    return encoder->reconfigure(width, height, linesize, offset, length);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_reconfigure failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_set_scale(FFmpegRamEncoder *encoder, int num,
+                                    int den) {
+  try {
+    return encoder->set_scale(num, den);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_set_scale failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_request_keyframe(FFmpegRamEncoder *encoder) {
+  try {
+    return encoder->request_keyframe();
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_request_keyframe failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_get_stats(FFmpegRamEncoder *encoder,
+                                    RamEncodeStats *stats) {
+  try {
+    return encoder->get_stats(stats);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_get_stats failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
 extern "C" void ffmpeg_ram_free_encoder(FFmpegRamEncoder *encoder) {
   try {
     if (!encoder)
@@ -463,4 +1169,22 @@ extern "C" int ffmpeg_ram_set_bitrate(FFmpegRamEncoder *encoder, int kbs) {
     LOG_ERROR("ffmpeg_ram_set_bitrate failed, " + std::string(e.what()));
   }
   return -1;
+}
+
+extern "C" int ffmpeg_ram_set_framerate(FFmpegRamEncoder *encoder, int fps) {
+  try {
+    return encoder->set_framerate(fps);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_set_framerate failed, " + std::string(e.what()));
+  }
+  return -1;
+}
+
+extern "C" int ffmpeg_ram_set_gop(FFmpegRamEncoder *encoder, int gop) {
+  try {
+    return encoder->set_gop(gop);
+  } catch (const std::exception &e) {
+    LOG_ERROR("ffmpeg_ram_set_gop failed, " + std::string(e.what()));
+  }
+  return -1;
 }
\ No newline at end of file
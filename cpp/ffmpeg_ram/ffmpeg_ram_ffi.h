@@ -5,30 +5,94 @@
 
 #define AV_NUM_DATA_POINTERS 8
 
+// changed is set on the first frame and whenever the size or pixfmt differs
+// from the previous frame
 typedef void (*RamDecodeCallback)(const void *obj, int width, int height,
                                   int pixfmt,
                                   int linesize[AV_NUM_DATA_POINTERS],
-                                  uint8_t *data[AV_NUM_DATA_POINTERS], int key);
+                                  uint8_t *data[AV_NUM_DATA_POINTERS], int key,
+                                  int changed);
+// layer is the temporal layer id, 0 without temporal layers
 typedef void (*RamEncodeCallback)(const uint8_t *data, int len, int64_t pts,
-                                  int key, const void *obj);
+                                  int key, int layer, const void *obj);
+
+// dirty region, qoffset in [-100, 100] percent, negative for better quality
+typedef struct RamEncodeRect {
+  int x;
+  int y;
+  int width;
+  int height;
+  int qoffset;
+} RamEncodeRect;
+
+// counters since the encoder was created, frame_cap is 0 without a cap
+typedef struct RamEncodeStats {
+  int64_t frames;
+  int64_t key_frames;
+  int64_t bytes;
+  int max_frame_size;
+  int frame_cap;
+  int64_t cap_hits;  // frames of at least 90% of the cap
+  int64_t cap_overs; // frames above the cap
+  int speed_level;   // Quality_Auto preset, 0 is the slowest, -1 otherwise
+  int encode_us;     // moving average of the encode time
+  int64_t scene_changes;
+  int64_t scene_change_bytes; // size of the keyframes they caused
+  int scene_score;            // last score, see EncodeContext.scene_change
+} RamEncodeStats;
 
 void *ffmpeg_ram_new_encoder(const char *name, const char *mc_name, int width,
                              int height, int pixfmt, int align, int fps,
                              int gop, int rc, int quality, int kbs, int q,
-                             int thread_count, int gpu, int *linesize,
-                             int *offset, int *length,
-                             RamEncodeCallback callback);
+                             int thread_count, int gpu,
+                             int static_keepalive_ms, int intra_refresh,
+                             int max_frame_bytes, int max_frame_ms,
+                             int scene_change, int scene_change_hold_ms,
+                             int temporal_layers, int *linesize, int *offset,
+                             int *length, RamEncodeCallback callback);
 void *ffmpeg_ram_new_decoder(const char *name, int device_type,
                              int thread_count, RamDecodeCallback callback);
 int ffmpeg_ram_encode(void *encoder, const uint8_t *data, int length,
                       const void *obj, int64_t ms);
+int ffmpeg_ram_encode_rects(void *encoder, const uint8_t *data, int length,
+                            const void *obj, int64_t ms,
+                            const RamEncodeRect *rects, int rect_count);
 int ffmpeg_ram_decode(void *decoder, const uint8_t *data, int length,
                       const void *obj);
+// Only the newest frame of the packet, a reference to the decoder's picture
+// or NULL. Read it with ffmpeg_ram_frame_info, release it with
+// ffmpeg_ram_free_frame.
+int ffmpeg_ram_decode_latest(void *decoder, const uint8_t *data, int length,
+                             void **frame);
+void ffmpeg_ram_frame_info(const void *frame, int *width, int *height,
+                           int *pixfmt, int *linesize, uint8_t **data,
+                           int *key);
+void ffmpeg_ram_free_frame(void *frame);
+// 0 is full quality, up to 3 trades picture quality for decode time. A
+// negative level adapts it to the packet rate.
+int ffmpeg_ram_set_decode_speed(void *decoder, int level);
+int ffmpeg_ram_get_decode_speed(void *decoder);
+// keyframe_only decodes keyframes only, other packets succeed without a
+// frame. The output is halved shift times, shift in [0, 3].
+int ffmpeg_ram_set_preview(void *decoder, int keyframe_only, int shift);
 void ffmpeg_ram_free_encoder(void *encoder);
 void ffmpeg_ram_free_decoder(void *decoder);
 int ffmpeg_ram_get_linesize_offset_length(int pix_fmt, int width, int height,
                                           int align, int *linesize, int *offset,
                                           int *length);
 int ffmpeg_ram_set_bitrate(void *encoder, int kbs);
+int ffmpeg_ram_set_framerate(void *encoder, int fps);
+int ffmpeg_ram_set_gop(void *encoder, int gop);
+int ffmpeg_ram_set_scale(void *encoder, int num, int den);
+int ffmpeg_ram_reconfigure(void *encoder, int width, int height, int *linesize,
+                           int *offset, int *length);
+int ffmpeg_ram_request_keyframe(void *encoder);
+int ffmpeg_ram_get_stats(void *encoder, RamEncodeStats *stats);
+// width x height is the source size, the output is half of it. Layouts as
+// returned by ffmpeg_ram_get_linesize_offset_length.
+int ffmpeg_ram_downscale_2x(int pix_fmt, int width, int height,
+                            const uint8_t *src, const int *src_linesize,
+                            const int *src_offset, uint8_t *dst,
+                            const int *dst_linesize, const int *dst_offset);
 
 #endif // FFMPEG_RAM_FFI_H
\ No newline at end of file
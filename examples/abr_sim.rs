@@ -0,0 +1,332 @@
+// Replays a bandwidth trace against a real software encoder driven by the
+// bitrate controller, in simulated time.
+//
+// cargo run --example abr_sim [trace] [encoder]
+//
+// A trace line is "<duration_ms> <kbps>", '#' starts a comment. Without a
+// trace a built-in one with drops and recoveries is used. The encoder
+// defaults to libx264.
+
+use env_logger::{init_from_env, Env, DEFAULT_FILTER_ENV};
+use hwcodec::{
+    bitrate::{BitrateConfig, BitrateController, BitrateTarget, TransportFeedback},
+    common::{Quality::*, RateControl::*},
+    ffmpeg::AVPixelFormat,
+    ffmpeg_ram::encode::{EncodeContext, Encoder},
+};
+use std::collections::VecDeque;
+
+const WIDTH: usize = 1280;
+const HEIGHT: usize = 720;
+const PACKET_SIZE: usize = 1200;
+// one way, the rtt without queuing is twice this
+const LINK_DELAY_MS: u64 = 20;
+// drop tail once the queue holds this much at the current capacity
+const MAX_QUEUE_MS: u64 = 300;
+const FEEDBACK_INTERVAL_MS: u64 = 100;
+
+fn main() {
+    init_from_env(Env::default().filter_or(DEFAULT_FILTER_ENV, "info"));
+
+    let args: Vec<String> = std::env::args().collect();
+    let trace = match args.get(1) {
+        Some(path) => load_trace(path),
+        None => vec![
+            (10_000, 4000),
+            (10_000, 1000),
+            (10_000, 2500),
+            (5_000, 300),
+            (15_000, 5000),
+        ],
+    };
+    let name = args.get(2).cloned().unwrap_or(String::from("libx264"));
+
+    let mut controller = BitrateController::new(BitrateConfig {
+        width: WIDTH as _,
+        height: HEIGHT as _,
+        min_kbs: 100,
+        max_kbs: 8000,
+        start_kbs: 1000,
+        min_fps: 10,
+        max_fps: 30,
+    })
+    .unwrap();
+    let mut target = controller.target();
+    let ctx = EncodeContext {
+        name,
+        mc_name: None,
+        width: target.width,
+        height: target.height,
+        pixfmt: AVPixelFormat::AV_PIX_FMT_NV12,
+        align: 0,
+        kbs: target.kbs,
+        fps: target.fps,
+        gop: i32::MAX,
+        quality: Quality_Default,
+        rc: RC_CBR,
+        thread_count: 4,
+        q: -1,
+        static_keepalive_ms: 0,
+        intra_refresh: 0,
+        max_frame_bytes: 0,
+        max_frame_ms: 0,
+        scene_change: 0,
+        scene_change_hold_ms: 0,
+        temporal_layers: 0,
+    };
+    let mut encoder = Encoder::new(ctx).unwrap();
+    let source = prepare_frames(WIDTH, HEIGHT, 60);
+
+    let duration: u64 = trace.iter().map(|t| t.0).sum();
+    let mut link = Link::new(trace);
+    let mut stats = Stats::default();
+    let mut next_frame_ms = 0;
+    let mut frame_index = 0;
+    let mut last_feedback_ms = 0;
+    println!("  s capacity estimate target   sent deliver  qdelay  loss fps resolution");
+    for ms in 0..duration {
+        if ms >= next_frame_ms {
+            if let Ok(encoded) = encoder.encode(&source[frame_index % source.len()], ms as _) {
+                for frame in encoded.iter() {
+                    controller.on_frame(frame.data.len());
+                    link.send(ms, frame.data.len());
+                    stats.sent_bytes += frame.data.len();
+                }
+            }
+            frame_index += 1;
+            next_frame_ms = ms + 1000 / target.fps as u64;
+        }
+
+        link.tick(ms);
+
+        if ms - last_feedback_ms >= FEEDBACK_INTERVAL_MS {
+            let feedback = link.feedback(ms - last_feedback_ms);
+            last_feedback_ms = ms;
+            stats.add(&feedback, link.capacity_kbps(ms));
+            if let Some(t) = controller.on_feedback(ms, &feedback) {
+                if t.kbs != target.kbs {
+                    encoder.set_bitrate(t.kbs).ok();
+                }
+                if t.fps != target.fps {
+                    encoder.set_framerate(t.fps).ok();
+                }
+                // the capture stays full size, the encoder downscales
+                if (t.scale_num, t.scale_den) != (target.scale_num, target.scale_den) {
+                    encoder.set_scale(t.scale_num, t.scale_den).ok();
+                }
+                target = t;
+            }
+        }
+
+        if (ms + 1) % 1000 == 0 {
+            stats.print_second(ms, controller.estimate_kbs(), target);
+        }
+    }
+    stats.print_summary();
+}
+
+fn load_trace(path: &str) -> Vec<(u64, u32)> {
+    let text = std::fs::read_to_string(path).unwrap();
+    text.lines()
+        .map(|l| l.split('#').next().unwrap_or_default().trim())
+        .filter(|l| !l.is_empty())
+        .map(|l| {
+            let mut it = l.split_whitespace().map(|v| v.parse::<u64>().unwrap());
+            (it.next().unwrap(), it.next().unwrap() as u32)
+        })
+        .collect()
+}
+
+// A drop-tail bottleneck queue with a fixed propagation delay.
+struct Link {
+    trace: Vec<(u64, u32)>,
+    // (send ms, bytes)
+    queue: VecDeque<(u64, usize)>,
+    queued_bytes: usize,
+    budget: f64,
+    delivered_bytes: usize,
+    sent_packets: usize,
+    lost_packets: usize,
+    last_delay_ms: u64,
+}
+
+impl Link {
+    fn new(trace: Vec<(u64, u32)>) -> Self {
+        Self {
+            trace,
+            queue: VecDeque::new(),
+            queued_bytes: 0,
+            budget: 0.0,
+            delivered_bytes: 0,
+            sent_packets: 0,
+            lost_packets: 0,
+            last_delay_ms: 0,
+        }
+    }
+
+    fn capacity_kbps(&self, ms: u64) -> u32 {
+        let mut end = 0;
+        for (duration, kbps) in self.trace.iter() {
+            end += duration;
+            if ms < end {
+                return *kbps;
+            }
+        }
+        self.trace.last().map_or(0, |t| t.1)
+    }
+
+    fn send(&mut self, ms: u64, bytes: usize) {
+        let limit = (self.capacity_kbps(ms) as u64 * MAX_QUEUE_MS / 8) as usize;
+        let mut left = bytes;
+        while left > 0 {
+            let size = left.min(PACKET_SIZE);
+            left -= size;
+            self.sent_packets += 1;
+            if self.queued_bytes + size > limit.max(PACKET_SIZE) {
+                self.lost_packets += 1;
+                continue;
+            }
+            self.queue.push_back((ms, size));
+            self.queued_bytes += size;
+        }
+    }
+
+    fn tick(&mut self, ms: u64) {
+        // kbit per second is bytes per millisecond * 8
+        self.budget += self.capacity_kbps(ms) as f64 / 8.0;
+        while let Some(&(sent, size)) = self.queue.front() {
+            if self.budget < size as f64 {
+                break;
+            }
+            self.budget -= size as f64;
+            self.queue.pop_front();
+            self.queued_bytes -= size;
+            self.delivered_bytes += size;
+            self.last_delay_ms = ms - sent;
+        }
+        if self.queue.is_empty() {
+            self.budget = self.budget.min(PACKET_SIZE as f64);
+        }
+    }
+
+    fn feedback(&mut self, interval_ms: u64) -> TransportFeedback {
+        let feedback = TransportFeedback {
+            interval_ms: interval_ms as _,
+            delivered_bytes: self.delivered_bytes,
+            rtt_ms: (2 * LINK_DELAY_MS + self.last_delay_ms) as _,
+            loss: if self.sent_packets > 0 {
+                self.lost_packets as f32 / self.sent_packets as f32
+            } else {
+                0.0
+            },
+        };
+        self.delivered_bytes = 0;
+        self.sent_packets = 0;
+        self.lost_packets = 0;
+        feedback
+    }
+}
+
+#[derive(Default)]
+struct Stats {
+    sent_bytes: usize,
+    delivered_bytes: usize,
+    capacity_kbits: u64,
+    delays: Vec<u32>,
+    losses: Vec<f32>,
+    second: Vec<(u32, TransportFeedback)>,
+    total_sent_bytes: usize,
+}
+
+impl Stats {
+    fn add(&mut self, feedback: &TransportFeedback, capacity_kbps: u32) {
+        self.delivered_bytes += feedback.delivered_bytes;
+        self.capacity_kbits += capacity_kbps as u64 * feedback.interval_ms as u64 / 1000;
+        self.delays.push(feedback.rtt_ms - 2 * LINK_DELAY_MS as u32);
+        self.losses.push(feedback.loss);
+        self.second.push((capacity_kbps, *feedback));
+    }
+
+    fn print_second(&mut self, ms: u64, estimate: i32, target: BitrateTarget) {
+        let n = self.second.len().max(1);
+        let capacity = self.second.iter().map(|s| s.0).sum::<u32>() as usize / n;
+        let delivered = self
+            .second
+            .iter()
+            .map(|s| s.1.delivered_bytes)
+            .sum::<usize>()
+            * 8
+            / 1000;
+        let delay = self.second.iter().map(|s| s.1.rtt_ms).sum::<u32>() as usize / n
+            - 2 * LINK_DELAY_MS as usize;
+        let loss = self.second.iter().map(|s| s.1.loss).sum::<f32>() / n as f32;
+        println!(
+            "{:3} {:8} {:8} {:6} {:6} {:7} {:5}ms {:4.1}% {:3} {}x{}",
+            (ms + 1) / 1000,
+            capacity,
+            estimate,
+            target.kbs,
+            self.sent_bytes * 8 / 1000,
+            delivered,
+            delay,
+            loss * 100.0,
+            target.fps,
+            target.width,
+            target.height
+        );
+        self.total_sent_bytes += self.sent_bytes;
+        self.sent_bytes = 0;
+        self.second.clear();
+    }
+
+    fn print_summary(&mut self) {
+        self.delays.sort();
+        let p95 = self
+            .delays
+            .get(self.delays.len() * 95 / 100)
+            .cloned()
+            .unwrap_or_default();
+        let avg = self.delays.iter().sum::<u32>() as usize / self.delays.len().max(1);
+        let loss = self.losses.iter().sum::<f32>() / self.losses.len().max(1) as f32;
+        println!(
+            "summary: utilization {:.1}%, sent {} KB, queue delay avg {}ms p95 {}ms, loss {:.2}%",
+            self.delivered_bytes as f64 * 8.0 / 10.0 / self.capacity_kbits.max(1) as f64,
+            self.total_sent_bytes / 1000,
+            avg,
+            p95,
+            loss * 100.0
+        );
+    }
+}
+
+// NV12 desktop-like frames, a static background, a scrolling text-like
+// region and a noisy video region keep the encoder busy at any bitrate
+fn prepare_frames(width: usize, height: usize, count: usize) -> Vec<Vec<u8>> {
+    let mut seed = 1u32;
+    let mut random = || {
+        seed = seed.wrapping_mul(1664525).wrapping_add(1013904223);
+        (seed >> 24) as u8
+    };
+    let mut ret = vec![];
+    for index in 0..count {
+        let mut yuv = vec![128u8; width * height * 3 / 2];
+        for y in 0..height {
+            for x in 0..width {
+                yuv[y * width + x] = if x < width / 2 {
+                    let row = (y + index * 4) % 16;
+                    if row < 10 && (x / 6 + (y + index * 4) / 16) % 3 != 0 {
+                        16
+                    } else {
+                        235
+                    }
+                } else if y < height / 2 {
+                    random()
+                } else {
+                    200
+                };
+            }
+        }
+        ret.push(yuv);
+    }
+    ret
+}
@@ -39,6 +39,13 @@ fn setup_ram(max_align: i32) {
             quality: Quality_Default,
             kbs: 0,
             q: -1,
+            static_keepalive_ms: 0,
+            intra_refresh: 0,
+            max_frame_bytes: 0,
+            max_frame_ms: 0,
+            scene_change: 0,
+            scene_change_hold_ms: 0,
+            temporal_layers: 0,
             thread_count: 1,
         },
         None,
@@ -106,6 +113,13 @@ fn test_ram(width: i32, height: i32, encode_info: CodecInfo, decode_info: CodecI
         rc: RC_CBR,
         thread_count: 1,
         q: -1,
+        static_keepalive_ms: 0,
+        intra_refresh: 0,
+        max_frame_bytes: 0,
+        max_frame_ms: 0,
+        scene_change: 0,
+        scene_change_hold_ms: 0,
+        temporal_layers: 0,
     };
     let decode_ctx = DecodeContext {
         name: decode_info.name.clone(),
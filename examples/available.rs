@@ -32,6 +32,13 @@ fn ram() {
         quality: Quality_Default,
         rc: RC_CBR,
         q: -1,
+        static_keepalive_ms: 0,
+        intra_refresh: 0,
+        max_frame_bytes: 0,
+        max_frame_ms: 0,
+        scene_change: 0,
+        scene_change_hold_ms: 0,
+        temporal_layers: 0,
         thread_count: 1,
     };
     let encoders = Encoder::available_encoders(ctx.clone(), None);
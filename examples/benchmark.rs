@@ -1,10 +1,16 @@
 use env_logger::{init_from_env, Env, DEFAULT_FILTER_ENV};
 use hwcodec::{
-    common::{Quality::*, RateControl::*},
-    ffmpeg::AVPixelFormat,
+    common::{
+        Quality::*,
+        RateControl::{self, *},
+    },
+    ffmpeg::{AVHWDeviceType, AVPixelFormat},
     ffmpeg_ram::{
         decode::{DecodeContext, Decoder},
         encode::{EncodeContext, Encoder},
+        pool::{SessionPool, SessionPoolConfig},
+        simulcast::Simulcast,
+        threaded::{InputFrame, InputMode, ThreadedEncoder},
         CodecInfo, CodecInfos,
     },
 };
@@ -29,6 +35,13 @@ fn main() {
         rc: RC_DEFAULT,
         thread_count: 4,
         q: -1,
+        static_keepalive_ms: 0,
+        intra_refresh: 0,
+        max_frame_bytes: 0,
+        max_frame_ms: 0,
+        scene_change: 0,
+        scene_change_hold_ms: 0,
+        temporal_layers: 0,
     };
     let yuv_count = 10;
     println!("benchmark");
@@ -37,13 +50,63 @@ fn main() {
     let encoders = Encoder::available_encoders(ctx.clone(), None);
     log::info!("encoders: {:?}", encoders);
     let best = CodecInfo::prioritized(encoders.clone());
-    for info in encoders {
+    for info in encoders.iter() {
         test_encoder(info.clone(), ctx.clone(), &yuvs, is_best(&best, &info));
     }
+    for info in encoders.iter() {
+        test_simulcast(info.clone(), ctx.clone(), &yuvs);
+        for (num, den) in [(1, 1), (3, 4), (1, 2)] {
+            test_scale(info.clone(), ctx.clone(), &yuvs, num, den);
+        }
+        test_reconfigure(info.clone(), ctx.clone());
+        test_pool(info.clone(), ctx.clone());
+        test_threaded(info.clone(), ctx.clone(), &yuvs);
+    }
+
+    let (width, height) = (ctx.width as usize, ctx.height as usize);
+    let mut desktop = Desktop::new(width, height, 4 * ctx.gop as usize, 0);
+    for info in encoders.iter() {
+        test_frame_size(info.clone(), ctx.clone(), &mut desktop, 0);
+        test_frame_size(info.clone(), ctx.clone(), &mut desktop, ctx.gop);
+        test_frame_cap(info.clone(), ctx.clone(), &mut desktop, 2 * 1000 / ctx.fps);
+        test_auto_speed(info.clone(), ctx.clone(), &mut desktop);
+    }
+
+    // a window switch every second, the whole picture changes
+    let mut switching = Desktop::new(width, height, 4 * ctx.gop as usize, ctx.fps as usize);
+    for info in encoders.iter() {
+        test_scene_change(info.clone(), ctx.clone(), &mut switching, 0);
+        test_scene_change(info.clone(), ctx.clone(), &mut switching, 50);
+    }
+
+    for info in encoders.iter() {
+        test_bitrate_change(info.clone(), ctx.clone(), &yuvs);
+    }
+
+    // not probed by available_encoders, opened by name
+    for name in ["libvpx", "libvpx-vp9"] {
+        for layers in [1, 2, 3] {
+            test_temporal_layers(name, ctx.clone(), &mut desktop, layers);
+        }
+    }
+
+    let mut still = Desktop::new(width, height, 1, 0);
+    let mut noise = yuvs.clone();
+    let mut contents: [(&str, &mut dyn Frames); 3] = [
+        ("static", &mut still),
+        ("desktop", &mut desktop),
+        ("noise", &mut noise),
+    ];
+    for info in encoders.iter() {
+        for (content, frames) in contents.iter_mut() {
+            test_session_bytes(info.clone(), ctx.clone(), content, *frames, RC_DEFAULT);
+            test_session_bytes(info.clone(), ctx.clone(), content, *frames, RC_CQ);
+        }
+    }
 
     let (h264s, h265s) = prepare_h26x(best, ctx.clone(), &yuvs);
 
-    let decoders = Decoder::available_decoders(None);
+    let decoders = Decoder::available_decoders();
     log::info!("decoders: {:?}", decoders);
     let best = CodecInfo::prioritized(decoders.clone());
     for info in decoders {
@@ -54,6 +117,13 @@ fn main() {
         };
         if h26xs.len() == yuv_count {
             test_decoder(info.clone(), h26xs, is_best(&best, &info));
+            test_decode_latest(info.clone(), h26xs);
+            test_preview(info.clone(), h26xs);
+            if info.hwdevice == AVHWDeviceType::AV_HWDEVICE_TYPE_NONE {
+                for level in 0..4 {
+                    test_decode_speed(info.clone(), h26xs, level);
+                }
+            }
         }
     }
 }
@@ -76,6 +146,365 @@ fn test_encoder(info: CodecInfo, ctx: EncodeContext, yuvs: &Vec<Vec<u8>>, best:
     );
 }
 
+// capture at twice the fps the encoder manages, latest frame wins
+fn test_threaded(info: CodecInfo, ctx: EncodeContext, yuvs: &Vec<Vec<u8>>) {
+    let mut ctx = ctx;
+    ctx.name = info.name;
+    let Ok(mut encoder) = ThreadedEncoder::new(ctx.clone(), InputMode::Latest, 16) else {
+        println!("{} threaded: failed", ctx.name);
+        return;
+    };
+    let interval = std::time::Duration::from_millis(500 / ctx.fps as u64);
+    let (mut packets, mut send) = (0, std::time::Duration::ZERO);
+    let start = Instant::now();
+    for i in 0..4 * ctx.fps as usize {
+        let frame = InputFrame {
+            data: yuvs[i % yuvs.len()].clone(),
+            ms: start.elapsed().as_millis() as _,
+        };
+        let t = Instant::now();
+        encoder.send(frame).ok();
+        send += t.elapsed();
+        while encoder.try_recv().is_some() {
+            packets += 1;
+        }
+        std::thread::sleep(interval);
+    }
+    println!(
+        "{} threaded: send {:?}, {} packets, {} frames replaced",
+        ctx.name,
+        send / (4 * ctx.fps) as u32,
+        packets,
+        encoder.dropped()
+    );
+}
+
+// time to take a pre-opened encoder vs opening one
+fn test_pool(info: CodecInfo, ctx: EncodeContext) {
+    let mut ctx = ctx;
+    ctx.name = info.name;
+    let pool = SessionPool::new(SessionPoolConfig {
+        encoders: vec![ctx.clone()],
+        decoders: vec![],
+        per_template: 1,
+        max_sessions: 1,
+    });
+    let start = Instant::now();
+    while pool.len() == 0 && start.elapsed().as_secs() < 10 {
+        std::thread::sleep(std::time::Duration::from_millis(10));
+    }
+    let start = Instant::now();
+    let taken = pool.take_encoder(&ctx).is_some();
+    let take = start.elapsed();
+    let start = Instant::now();
+    let opened = Encoder::new(ctx.clone()).is_ok();
+    println!(
+        "{} session: pool {:?}{}, new {:?}{}",
+        ctx.name,
+        take,
+        if taken { "" } else { " (miss)" },
+        start.elapsed(),
+        if opened { "" } else { " (failed)" }
+    );
+}
+
+// 1080p -> 720p -> 1080p, in place vs a new encoder, until the first frame
+fn test_reconfigure(info: CodecInfo, ctx: EncodeContext) {
+    let mut ctx = ctx;
+    ctx.name = info.name;
+    let sizes = [(1280, 720), (1920, 1080)];
+    let Ok(mut encoder) = Encoder::new(ctx.clone()) else {
+        return;
+    };
+    let mut in_place = std::time::Duration::ZERO;
+    let mut recreate = std::time::Duration::ZERO;
+    for (width, height) in sizes {
+        let start = Instant::now();
+        if encoder.reconfigure(width, height).is_err() {
+            println!("{} reconfigure {}x{}: failed", ctx.name, width, height);
+            return;
+        }
+        let yuv = vec![0u8; encoder.length as usize];
+        encoder.encode(&yuv, 0).ok();
+        in_place += start.elapsed();
+
+        let start = Instant::now();
+        let Ok(mut new) = Encoder::new(EncodeContext {
+            width,
+            height,
+            ..ctx.clone()
+        }) else {
+            return;
+        };
+        new.encode(&yuv, 0).ok();
+        recreate += start.elapsed();
+    }
+    println!(
+        "{} resolution switch: reconfigure {:?}, new encoder {:?}",
+        ctx.name,
+        in_place / sizes.len() as _,
+        recreate / sizes.len() as _
+    );
+}
+
+// encode time per frame with the built-in downscale, full size input
+fn test_scale(info: CodecInfo, ctx: EncodeContext, yuvs: &Vec<Vec<u8>>, num: i32, den: i32) {
+    let mut ctx = ctx;
+    ctx.name = info.name;
+    let Ok(mut encoder) = Encoder::new(ctx.clone()) else {
+        return;
+    };
+    if encoder.set_scale(num, den).is_err() {
+        println!("{} scale {}/{}: failed", ctx.name, num, den);
+        return;
+    }
+    let mut bytes = 0;
+    let start = Instant::now();
+    for yuv in yuvs {
+        if let Ok(frames) = encoder.encode(yuv, start.elapsed().as_millis() as _) {
+            bytes += frames.iter().map(|f| f.data.len()).sum::<usize>();
+        }
+    }
+    println!(
+        "{} scale {}/{}: {:?}, {} bytes",
+        ctx.name,
+        num,
+        den,
+        start.elapsed() / yuvs.len() as _,
+        bytes
+    );
+}
+
+// full, half and quarter size from one input, time per input frame
+fn test_simulcast(info: CodecInfo, ctx: EncodeContext, yuvs: &Vec<Vec<u8>>) {
+    let mut ctx = ctx;
+    ctx.name = info.name;
+    let kbs = [ctx.kbs, ctx.kbs / 3, ctx.kbs / 8];
+    let Ok(mut simulcast) = Simulcast::new(ctx.clone(), &kbs) else {
+        println!("{} simulcast: failed", ctx.name);
+        return;
+    };
+    let mut bytes = [0usize; 3];
+    let start = Instant::now();
+    for yuv in yuvs {
+        if let Ok(frames) = simulcast.encode(yuv, start.elapsed().as_millis() as _) {
+            for f in frames.iter() {
+                bytes[f.rung] += f.frame.data.len();
+            }
+        }
+    }
+    println!(
+        "{} simulcast: {:?}, rung bytes {:?}",
+        ctx.name,
+        start.elapsed() / yuvs.len() as _,
+        bytes
+    );
+}
+
+// keyframe spikes vs gradual intra refresh on mostly static content
+fn test_frame_size(
+    info: CodecInfo,
+    ctx: EncodeContext,
+    frames: &mut dyn Frames,
+    intra_refresh: i32,
+) {
+    let mut ctx = ctx;
+    ctx.name = info.name;
+    ctx.intra_refresh = intra_refresh;
+    let Ok(mut encoder) = Encoder::new(ctx.clone()) else {
+        println!("{} intra_refresh:{}: failed", ctx.name, intra_refresh);
+        return;
+    };
+    let mut sizes = vec![];
+    for i in 0..frames.len() {
+        if let Ok(encoded) = encoder.encode(frames.frame(i), (i * 1000 / ctx.fps as usize) as _) {
+            sizes.extend(encoded.iter().map(|f| f.data.len()));
+        }
+    }
+    // the first frame is a keyframe in both modes
+    let sizes = &sizes[1.min(sizes.len())..];
+    if sizes.is_empty() {
+        return;
+    }
+    let avg = sizes.iter().sum::<usize>() / sizes.len();
+    let max = sizes.iter().max().cloned().unwrap_or_default();
+    println!(
+        "{} intra_refresh:{}: avg {} bytes, max {} bytes, max/avg {:.1}",
+        ctx.name,
+        intra_refresh,
+        avg,
+        max,
+        max as f64 / avg.max(1) as f64
+    );
+}
+
+// how often frames reach a cap of max_frame_ms link time
+fn test_frame_cap(info: CodecInfo, ctx: EncodeContext, frames: &mut dyn Frames, max_frame_ms: i32) {
+    let mut ctx = ctx;
+    ctx.name = info.name;
+    ctx.max_frame_ms = max_frame_ms;
+    let Ok(mut encoder) = Encoder::new(ctx.clone()) else {
+        println!("{} max_frame_ms:{}: failed", ctx.name, max_frame_ms);
+        return;
+    };
+    for i in 0..frames.len() {
+        encoder
+            .encode(frames.frame(i), (i * 1000 / ctx.fps as usize) as _)
+            .ok();
+    }
+    if let Ok(stats) = encoder.stats() {
+        println!(
+            "{} max_frame_ms:{}: cap {} bytes, max {} bytes, {}/{} frames hit the cap, {} above",
+            ctx.name,
+            max_frame_ms,
+            stats.frame_cap,
+            stats.max_frame_size,
+            stats.cap_hits,
+            stats.frames,
+            stats.cap_overs
+        );
+    }
+}
+
+// the preset Quality_Auto settles on and the encode time there
+fn test_auto_speed(info: CodecInfo, ctx: EncodeContext, frames: &mut dyn Frames) {
+    let mut ctx = ctx;
+    ctx.name = info.name;
+    ctx.quality = Quality_Auto;
+    let Ok(mut encoder) = Encoder::new(ctx.clone()) else {
+        println!("{} Quality_Auto: failed", ctx.name);
+        return;
+    };
+    for i in 0..frames.len() {
+        encoder
+            .encode(frames.frame(i), (i * 1000 / ctx.fps as usize) as _)
+            .ok();
+    }
+    if let Ok(stats) = encoder.stats() {
+        println!(
+            "{} Quality_Auto: speed level {}, encode {}us",
+            ctx.name, stats.speed_level, stats.encode_us
+        );
+    }
+}
+
+// size spikes on window switches, as P-frames or scene change IDRs
+fn test_scene_change(
+    info: CodecInfo,
+    ctx: EncodeContext,
+    frames: &mut dyn Frames,
+    scene_change: i32,
+) {
+    let mut ctx = ctx;
+    ctx.name = info.name;
+    ctx.scene_change = scene_change;
+    ctx.scene_change_hold_ms = 500;
+    let Ok(mut encoder) = Encoder::new(ctx.clone()) else {
+        println!("{} scene_change:{}: failed", ctx.name, scene_change);
+        return;
+    };
+    for i in 0..frames.len() {
+        encoder
+            .encode(frames.frame(i), (i * 1000 / ctx.fps as usize) as _)
+            .ok();
+    }
+    if let Ok(stats) = encoder.stats() {
+        println!(
+            "{} scene_change:{}: {} KB, max {} bytes, {} scene changes, {} KB on their keyframes",
+            ctx.name,
+            scene_change,
+            stats.bytes / 1000,
+            stats.max_frame_size,
+            stats.scene_changes,
+            stats.scene_change_bytes / 1000
+        );
+    }
+}
+
+// bytes per temporal layer, what a receiver of only the lower layers gets
+fn test_temporal_layers(name: &str, ctx: EncodeContext, frames: &mut dyn Frames, layers: i32) {
+    let mut ctx = ctx;
+    ctx.name = name.to_owned();
+    // libvpx takes no NV12, same length, the chroma just reads differently
+    ctx.pixfmt = AVPixelFormat::AV_PIX_FMT_YUV420P;
+    ctx.temporal_layers = layers;
+    let Ok(mut encoder) = Encoder::new(ctx.clone()) else {
+        println!("{} temporal_layers:{}: failed", name, layers);
+        return;
+    };
+    let mut bytes = [0usize; 3];
+    for i in 0..frames.len() {
+        if let Ok(encoded) = encoder.encode(frames.frame(i), (i * 1000 / ctx.fps as usize) as _) {
+            for frame in encoded.iter() {
+                bytes[frame.layer as usize] += frame.data.len();
+            }
+        }
+    }
+    println!(
+        "{} temporal_layers:{}: layer bytes {:?}",
+        name, layers, bytes
+    );
+}
+
+// output bitrate per second, the target is halved after two seconds
+fn test_bitrate_change(info: CodecInfo, ctx: EncodeContext, yuvs: &Vec<Vec<u8>>) {
+    let mut ctx = ctx;
+    ctx.name = info.name;
+    let Ok(mut encoder) = Encoder::new(ctx.clone()) else {
+        println!("{} bitrate change: failed", ctx.name);
+        return;
+    };
+    let fps = ctx.fps as usize;
+    let target = ctx.kbs / 2;
+    let mut bytes = vec![0; 5];
+    for i in 0..5 * fps {
+        if i == 2 * fps && encoder.set_bitrate(target).is_err() {
+            println!("{} set_bitrate: failed", ctx.name);
+            return;
+        }
+        if let Ok(frames) = encoder.encode(&yuvs[i % yuvs.len()], (i * 1000 / fps) as _) {
+            bytes[i / fps] += frames.iter().map(|f| f.data.len()).sum::<usize>();
+        }
+    }
+    let kbps: Vec<usize> = bytes.iter().map(|b| b * 8 / 1000).collect();
+    // first second after the change within 15% of the target
+    let target_kbps = target as usize;
+    let converged = (2..5).find(|&s| kbps[s].abs_diff(target_kbps) * 100 <= target_kbps * 15);
+    println!(
+        "{} bitrate {} -> {} kbps: {:?} kbps per second, converged {}",
+        ctx.name,
+        ctx.kbs,
+        target,
+        kbps,
+        converged.map_or("never".to_string(), |s| format!("within {}s", s - 1)),
+    );
+}
+
+// bytes for a ten second session, rate control vs capped constant quality
+fn test_session_bytes(
+    info: CodecInfo,
+    ctx: EncodeContext,
+    content: &str,
+    frames: &mut dyn Frames,
+    rc: RateControl,
+) {
+    let mut ctx = ctx;
+    ctx.name = info.name;
+    ctx.rc = rc;
+    let Ok(mut encoder) = Encoder::new(ctx.clone()) else {
+        println!("{} {} {:?}: failed", ctx.name, content, rc);
+        return;
+    };
+    let mut bytes = 0;
+    for i in 0..10 * ctx.fps as usize {
+        let frame = frames.frame(i % frames.len());
+        if let Ok(encoded) = encoder.encode(frame, (i * 1000 / ctx.fps as usize) as _) {
+            bytes += encoded.iter().map(|f| f.data.len()).sum::<usize>();
+        }
+    }
+    println!("{} {} {:?}: {} KB", ctx.name, content, rc, bytes / 1000);
+}
+
 fn test_decoder(info: CodecInfo, h26xs: &Vec<Vec<u8>>, best: bool) {
     let ctx = DecodeContext {
         name: info.name,
@@ -101,6 +530,97 @@ fn test_decoder(info: CodecInfo, h26xs: &Vec<Vec<u8>>, best: bool) {
     );
 }
 
+fn test_decode_speed(info: CodecInfo, h26xs: &Vec<Vec<u8>>, level: i32) {
+    let ctx = DecodeContext {
+        name: info.name,
+        device_type: info.hwdevice,
+        thread_count: 4,
+    };
+    let mut decoder = Decoder::new(ctx.clone()).unwrap();
+    decoder.set_speed(level).unwrap();
+    let start = Instant::now();
+    let mut frames = 0;
+    for h26x in h26xs {
+        if let Ok(decoded) = decoder.decode(h26x) {
+            frames += decoded.len();
+        }
+    }
+    println!(
+        "{} speed {}: {:?}, {} frames",
+        ctx.name,
+        level,
+        start.elapsed() / h26xs.len() as u32,
+        frames
+    );
+}
+
+// keyframes only at a quarter of the size, vs a full decode
+fn test_preview(info: CodecInfo, h26xs: &Vec<Vec<u8>>) {
+    let ctx = DecodeContext {
+        name: info.name,
+        device_type: info.hwdevice,
+        thread_count: 4,
+    };
+    let mut decoder = Decoder::new(ctx.clone()).unwrap();
+    decoder.set_preview(true, 2).unwrap();
+    let start = Instant::now();
+    let (mut frames, mut size) = (0, (0, 0));
+    for h26x in h26xs {
+        if let Ok(decoded) = decoder.decode(h26x) {
+            for frame in decoded.iter() {
+                frames += 1;
+                size = (frame.width, frame.height);
+            }
+        }
+    }
+    println!(
+        "{} preview: {:?}, {} frames of {}x{}",
+        ctx.name,
+        start.elapsed() / h26xs.len() as u32,
+        frames,
+        size.0,
+        size.1
+    );
+}
+
+// a renderer thread taking the newest picture, no copies
+fn test_decode_latest(info: CodecInfo, h26xs: &Vec<Vec<u8>>) {
+    let ctx = DecodeContext {
+        name: info.name,
+        device_type: info.hwdevice,
+        thread_count: 4,
+    };
+    let mut decoder = Decoder::new(ctx.clone()).unwrap();
+    let latest = decoder.latest_frame();
+    let done = std::sync::Arc::new(std::sync::atomic::AtomicBool::new(false));
+    let renderer_done = done.clone();
+    let renderer = std::thread::spawn(move || {
+        let mut shown = 0;
+        while !renderer_done.load(std::sync::atomic::Ordering::Acquire) {
+            if latest.wait(std::time::Duration::from_millis(10)).is_some() {
+                shown += 1;
+                // a slow renderer
+                std::thread::sleep(std::time::Duration::from_millis(5));
+            }
+        }
+        (shown, latest.replaced())
+    });
+    let start = Instant::now();
+    for h26x in h26xs {
+        decoder.decode_latest(h26x).ok();
+    }
+    let elapsed = start.elapsed();
+    done.store(true, std::sync::atomic::Ordering::Release);
+    let (shown, replaced) = renderer.join().unwrap();
+    println!(
+        "{} latest: {:?}, {} shown, {} replaced",
+        ctx.name,
+        elapsed / h26xs.len() as u32,
+        shown,
+        replaced
+    );
+}
+
 fn prepare_yuv(width: usize, height: usize, count: usize) -> Vec<Vec<u8>> {
     let mut ret = vec![];
     for index in 0..count {
@@ -119,6 +639,96 @@ fn prepare_yuv(width: usize, height: usize, count: usize) -> Vec<Vec<u8>> {
     ret
 }
 
+// Frames by index, stored or drawn on demand.
+trait Frames {
+    fn len(&self) -> usize;
+    fn frame(&mut self, index: usize) -> &[u8];
+}
+
+impl Frames for Vec<Vec<u8>> {
+    fn len(&self) -> usize {
+        Vec::len(self)
+    }
+
+    fn frame(&mut self, index: usize) -> &[u8] {
+        &self[index]
+    }
+}
+
+// NV12 desktop-like frames, static background with a small moving window.
+// Drawn into one buffer as they are asked for, a few gops of 1080p would
+// take hundreds of MB. With switch_every the luma is inverted every other
+// switch_every frames, a window switch that changes the whole picture.
+struct Desktop {
+    width: usize,
+    height: usize,
+    count: usize,
+    switch_every: usize,
+    yuv: Vec<u8>,
+    // the window drawn in yuv and whether yuv is inverted
+    window: Option<(usize, usize)>,
+    inverted: bool,
+}
+
+impl Desktop {
+    fn new(width: usize, height: usize, count: usize, switch_every: usize) -> Self {
+        let mut yuv = vec![128u8; width * height * 3 / 2];
+        for y in 0..height {
+            for x in 0..width {
+                yuv[y * width + x] = Self::background(x, y);
+            }
+        }
+        Self {
+            width,
+            height,
+            count,
+            switch_every,
+            yuv,
+            window: None,
+            inverted: false,
+        }
+    }
+
+    fn background(x: usize, y: usize) -> u8 {
+        ((x / 64 + y / 64) % 2 * 64 + 64) as u8
+    }
+}
+
+impl Frames for Desktop {
+    fn len(&self) -> usize {
+        self.count
+    }
+
+    // only the window moves, the rest of the buffer is reused
+    fn frame(&mut self, index: usize) -> &[u8] {
+        let width = self.width;
+        let (w, h) = (width / 8, self.height / 8);
+        let inverted = self.switch_every > 0 && index / self.switch_every % 2 == 1;
+        let luma = |v: u8| if inverted { 255 - v } else { v };
+        if inverted != self.inverted {
+            let size = width * self.height;
+            self.yuv[..size].iter_mut().for_each(|y| *y = 255 - *y);
+            self.inverted = inverted;
+        }
+        if let Some((left, top)) = self.window.take() {
+            for y in top..top + h {
+                for x in left..left + w {
+                    self.yuv[y * width + x] = luma(Self::background(x, y));
+                }
+            }
+        }
+        let left = index * 8 % (width - w);
+        let top = index * 4 % (self.height - h);
+        for y in top..top + h {
+            for x in left..left + w {
+                self.yuv[y * width + x] = luma(((x + y) % 256) as u8);
+            }
+        }
+        self.window = Some((left, top));
+        &self.yuv
+    }
+}
+
 fn prepare_h26x(
     best: CodecInfos,
     ctx: EncodeContext,
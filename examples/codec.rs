@@ -30,6 +30,13 @@ fn main() {
         rc: RC_DEFAULT,
         thread_count: 4,
         q: -1,
+        static_keepalive_ms: 0,
+        intra_refresh: 0,
+        max_frame_bytes: 0,
+        max_frame_ms: 0,
+        scene_change: 0,
+        scene_change_hold_ms: 0,
+        temporal_layers: 0,
     };
     let decode_ctx = DecodeContext {
         name: String::from("hevc"),
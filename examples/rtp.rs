@@ -0,0 +1,223 @@
+// Sends a software-encoded stream through the RTP packetizer, a lossy
+// reordering link and the depacketizer into a decoder, requesting a keyframe
+// whenever an access unit arrives after a loss.
+//
+// cargo run --example rtp [loss %] [reorder packets] [encoder]
+//
+// Defaults are 2% loss, packets delayed by up to 8 places and libx264;
+// libx265 sends H.265.
+
+use env_logger::{init_from_env, Env, DEFAULT_FILTER_ENV};
+use hwcodec::{
+    common::{DataFormat::*, Quality::*, RateControl::*},
+    ffmpeg::{AVHWDeviceType::*, AVPixelFormat},
+    ffmpeg_ram::{
+        decode::{DecodeContext, Decoder},
+        encode::{EncodeContext, Encoder},
+    },
+    rtp::{Depacketizer, Packetizer, RtpConfig, CLOCK_RATE},
+};
+use rand::random;
+
+const WIDTH: usize = 1280;
+const HEIGHT: usize = 720;
+const FPS: i32 = 30;
+const FRAMES: usize = 300;
+const MTU: usize = 1200;
+
+fn main() {
+    init_from_env(Env::default().filter_or(DEFAULT_FILTER_ENV, "info"));
+
+    let args: Vec<String> = std::env::args().collect();
+    let loss: f64 = args.get(1).map_or(2.0, |a| a.parse().unwrap()) / 100.0;
+    let reorder: usize = args.get(2).map_or(8, |a| a.parse().unwrap());
+    let name = args.get(3).cloned().unwrap_or(String::from("libx264"));
+    let (format, decoder_name) = if name.contains("265") || name.contains("hevc") {
+        (H265, "hevc")
+    } else {
+        (H264, "h264")
+    };
+
+    let mut encoder = Encoder::new(EncodeContext {
+        name,
+        mc_name: None,
+        width: WIDTH as _,
+        height: HEIGHT as _,
+        pixfmt: AVPixelFormat::AV_PIX_FMT_NV12,
+        align: 0,
+        kbs: 2000,
+        fps: FPS,
+        gop: i32::MAX,
+        quality: Quality_Default,
+        rc: RC_CBR,
+        thread_count: 4,
+        q: -1,
+        static_keepalive_ms: 0,
+        intra_refresh: 0,
+        max_frame_bytes: 0,
+        max_frame_ms: 0,
+        scene_change: 0,
+        scene_change_hold_ms: 0,
+        temporal_layers: 0,
+    })
+    .unwrap();
+    let mut decoder = Decoder::new(DecodeContext {
+        name: decoder_name.to_owned(),
+        device_type: AV_HWDEVICE_TYPE_NONE,
+        thread_count: 4,
+    })
+    .unwrap();
+    let mut packetizer = Packetizer::new(
+        format,
+        RtpConfig {
+            mtu: MTU,
+            payload_type: 96,
+            ssrc: random(),
+            first_seq: random(),
+        },
+    )
+    .unwrap();
+    // a packet overtaken by reorder others is still in time
+    let mut depacketizer = Depacketizer::new(format, reorder + 1).unwrap();
+    let source = prepare_frames(WIDTH, HEIGHT, 30);
+
+    let mut link = Link::new(loss, reorder);
+    let mut stats = Stats::default();
+    let mut waiting_key = false;
+    for i in 0..FRAMES {
+        let ms = i as i64 * 1000 / FPS as i64;
+        let Ok(frames) = encoder.encode(&source[i % source.len()], ms) else {
+            continue;
+        };
+        for frame in frames.iter() {
+            stats.frames += 1;
+            if frame.key != 0 {
+                stats.keyframes += 1;
+            }
+            let timestamp = (frame.pts as u64 * CLOCK_RATE as u64 / 1000) as u32;
+            for packet in packetizer.packetize(frame, timestamp) {
+                stats.packets += 1;
+                stats.bytes += packet.len();
+                // a socket would take packet.iovecs() without the copy
+                link.send(packet.to_vec());
+            }
+        }
+        let mut keyframe_needed = false;
+        for packet in link.deliver() {
+            depacketizer.push(&packet).ok();
+            while let Some(unit) = depacketizer.pop() {
+                stats.units += 1;
+                // after a loss only a keyframe decodes cleanly
+                if unit.discontinuity {
+                    stats.discontinuities += 1;
+                    waiting_key = true;
+                    keyframe_needed = true;
+                }
+                if waiting_key && !unit.keyframe {
+                    stats.skipped += 1;
+                    continue;
+                }
+                waiting_key = false;
+                match decoder.decode(&unit.data) {
+                    Ok(decoded) if !decoded.is_empty() => stats.decoded += decoded.len(),
+                    _ => {
+                        stats.errors += 1;
+                        waiting_key = true;
+                        keyframe_needed = true;
+                    }
+                }
+            }
+        }
+        // an instant PLI, a real receiver would send it over RTCP
+        if keyframe_needed {
+            stats.requests += 1;
+            encoder.request_keyframe().ok();
+        }
+    }
+    println!(
+        "{} frames ({} keyframes) in {} packets, {} KB, {} lost",
+        stats.frames,
+        stats.keyframes,
+        stats.packets,
+        stats.bytes / 1000,
+        depacketizer.lost()
+    );
+    println!(
+        "received {} access units, {} after a loss, {} decoded, {} errors, {} skipped waiting for a keyframe, {} keyframe requests",
+        stats.units,
+        stats.discontinuities,
+        stats.decoded,
+        stats.errors,
+        stats.skipped,
+        stats.requests
+    );
+}
+
+#[derive(Default)]
+struct Stats {
+    frames: usize,
+    keyframes: usize,
+    packets: usize,
+    bytes: usize,
+    units: usize,
+    discontinuities: usize,
+    decoded: usize,
+    errors: usize,
+    skipped: usize,
+    requests: usize,
+}
+
+// Drops packets at random and delivers the rest late by up to reorder places.
+struct Link {
+    loss: f64,
+    reorder: usize,
+    sent: usize,
+    // by position in the delivery order
+    queue: Vec<(usize, Vec<u8>)>,
+}
+
+impl Link {
+    fn new(loss: f64, reorder: usize) -> Self {
+        Self {
+            loss,
+            reorder,
+            sent: 0,
+            queue: vec![],
+        }
+    }
+
+    fn send(&mut self, packet: Vec<u8>) {
+        let position = self.sent + random::<usize>() % (self.reorder + 1);
+        self.sent += 1;
+        if random::<f64>() >= self.loss {
+            self.queue.push((position, packet));
+        }
+    }
+
+    // what was sent, except packets a later one may still overtake
+    fn deliver(&mut self) -> Vec<Vec<u8>> {
+        self.queue.sort_by_key(|(position, _)| *position);
+        let due = self
+            .queue
+            .iter()
+            .take_while(|(position, _)| *position < self.sent)
+            .count();
+        self.queue.drain(..due).map(|(_, packet)| packet).collect()
+    }
+}
+
+// NV12 frames, a moving gradient with some noise
+fn prepare_frames(width: usize, height: usize, count: usize) -> Vec<Vec<u8>> {
+    (0..count)
+        .map(|index| {
+            let mut yuv = vec![128u8; width * height * 3 / 2];
+            for y in 0..height {
+                for x in 0..width {
+                    yuv[y * width + x] =
+                        ((x + y + index * 8) % 256) as u8 ^ (random::<u8>() & 0x0f);
+                }
+            }
+            yuv
+        })
+        .collect()
+}
@@ -0,0 +1,32 @@
+// Arbitrary bytes through the Annex-B parser as H.264 and H.265, which must
+// return None or fewer NALs, never panic.
+//
+// cargo +nightly fuzz run nal
+
+#![no_main]
+
+use hwcodec::{common::DataFormat::*, nal};
+use libfuzzer_sys::fuzz_target;
+
+fuzz_target!(|data: &[u8]| {
+    // behind a start code too, so the input reaches the SPS/VPS reader
+    // without the fuzzer having to find one
+    let mut annexb = vec![0, 0, 1];
+    annexb.extend_from_slice(data);
+    for format in [H264, H265] {
+        for buf in [data, &annexb[..]] {
+            for n in nal::nals(format, buf) {
+                n.is_keyframe();
+                n.is_idr();
+                n.is_parameter_set();
+                n.is_slice();
+                n.temporal_id();
+                nal::parse_sps(&n);
+                nal::parse_vps(&n);
+                nal::NalUnit::from(n).data(buf);
+            }
+            nal::find_sps(format, buf);
+            nal::is_keyframe(format, buf);
+        }
+    }
+});
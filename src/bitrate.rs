@@ -0,0 +1,240 @@
+// Congestion-aware bitrate control.
+//
+// Transport feedback and encoded frame sizes go in. A target bitrate, fps and
+// resolution come out. Apply the bitrate with `Encoder::set_bitrate` and the
+// fps with `Encoder::set_framerate`. Apply the resolution with
+// `Encoder::set_scale(scale_num, scale_den)` on the full size input, or
+// `Encoder::reconfigure(width, height)` when the capture itself is scaled,
+// both keep the encoder. Delay-based like GCC: a growing queue or loss cuts the
+// estimate to what was actually delivered, a quiet link lets it grow again,
+// slowly near the rate where congestion was last seen.
+
+use std::collections::VecDeque;
+
+// queuing delay above which the link counts as congested
+const QUEUE_DELAY_HIGH_MS: u32 = 100;
+// queuing delay below which the estimate may grow
+const QUEUE_DELAY_LOW_MS: u32 = 30;
+const LOSS_HIGH: f32 = 0.1;
+const LOSS_LOW: f32 = 0.02;
+const DECREASE_FACTOR: f64 = 0.85;
+// per second, far from and near the last congestion point
+const INCREASE_FACTOR: f64 = 1.2;
+const INCREASE_NEAR_KBS: f64 = 50.0;
+const MIN_RTT_WINDOW_MS: u64 = 10_000;
+// increases reopen some encoders, see Encoder::set_bitrate
+const INCREASE_INTERVAL_MS: u64 = 1000;
+const INCREASE_MIN_STEP: f64 = 0.1;
+const DECREASE_MIN_STEP: f64 = 0.05;
+// bits per pixel below which fps and then resolution are lowered
+const MIN_BPP: f64 = 0.02;
+const LEVEL_UP_BPP: f64 = MIN_BPP * 1.5;
+const LEVEL_INTERVAL_MS: u64 = 5000;
+
+#[derive(Debug, Clone)]
+pub struct BitrateConfig {
+    pub width: i32,
+    pub height: i32,
+    pub min_kbs: i32,
+    pub max_kbs: i32,
+    pub start_kbs: i32,
+    pub min_fps: i32,
+    pub max_fps: i32,
+}
+
+// What the receiver reported for the interval since the previous feedback.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct TransportFeedback {
+    pub interval_ms: u32,
+    pub delivered_bytes: usize,
+    pub rtt_ms: u32,
+    // fraction of packets lost, 0.0 to 1.0
+    pub loss: f32,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct BitrateTarget {
+    // encoder setting, already compensated for encoder overshoot
+    pub kbs: i32,
+    pub fps: i32,
+    pub width: i32,
+    pub height: i32,
+    // width and height as a fraction of the configured size
+    pub scale_num: i32,
+    pub scale_den: i32,
+}
+
+pub struct BitrateController {
+    config: BitrateConfig,
+    // (fps, scale numerator, scale denominator), best first
+    levels: Vec<(i32, i32, i32)>,
+    level: usize,
+    estimate_kbs: f64,
+    // encoder output over the requested bitrate
+    overshoot: f64,
+    frame_bytes: usize,
+    rtts: VecDeque<(u64, u32)>,
+    congested_kbs: Option<f64>,
+    last_decrease_ms: Option<u64>,
+    last_increase_ms: u64,
+    last_level_ms: u64,
+    target: BitrateTarget,
+}
+
+impl BitrateController {
+    // Fails unless the size and min_kbs are positive and min_kbs <= max_kbs.
+    pub fn new(config: BitrateConfig) -> Result<Self, ()> {
+        if config.width <= 0
+            || config.height <= 0
+            || config.min_kbs <= 0
+            || config.min_kbs > config.max_kbs
+        {
+            return Err(());
+        }
+        let max_fps = config.max_fps.max(1);
+        let min_fps = config.min_fps.clamp(1, max_fps);
+        let mut levels: Vec<(i32, i32, i32)> = vec![];
+        for fps in [max_fps, max_fps * 2 / 3, max_fps / 2, min_fps] {
+            let fps = fps.max(min_fps);
+            if levels.last().map_or(true, |l| l.0 != fps) {
+                levels.push((fps, 1, 1));
+            }
+        }
+        levels.push((min_fps, 3, 4));
+        levels.push((min_fps, 1, 2));
+        let estimate_kbs = config.start_kbs.clamp(config.min_kbs, config.max_kbs) as f64;
+        let target = BitrateTarget {
+            kbs: estimate_kbs as i32,
+            fps: max_fps,
+            width: config.width,
+            height: config.height,
+            scale_num: 1,
+            scale_den: 1,
+        };
+        Ok(Self {
+            config,
+            levels,
+            level: 0,
+            estimate_kbs,
+            overshoot: 1.0,
+            frame_bytes: 0,
+            rtts: VecDeque::new(),
+            congested_kbs: None,
+            last_decrease_ms: None,
+            last_increase_ms: 0,
+            last_level_ms: 0,
+            target,
+        })
+    }
+
+    pub fn target(&self) -> BitrateTarget {
+        self.target
+    }
+
+    pub fn estimate_kbs(&self) -> i32 {
+        self.estimate_kbs as i32
+    }
+
+    // size of every encoded frame, key frames included
+    pub fn on_frame(&mut self, bytes: usize) {
+        self.frame_bytes += bytes;
+    }
+
+    // ms is a monotonic clock. Returns the new target when it changed.
+    pub fn on_feedback(&mut self, ms: u64, feedback: &TransportFeedback) -> Option<BitrateTarget> {
+        let interval_ms = feedback.interval_ms.max(1);
+        // bytes per millisecond * 8 is kbit per second
+        let delivered_kbs = (feedback.delivered_bytes * 8) as f64 / interval_ms as f64;
+        let sent_kbs = (self.frame_bytes * 8) as f64 / interval_ms as f64;
+        self.frame_bytes = 0;
+
+        while self
+            .rtts
+            .front()
+            .map_or(false, |r| r.0 + MIN_RTT_WINDOW_MS < ms)
+        {
+            self.rtts.pop_front();
+        }
+        while self.rtts.back().map_or(false, |r| r.1 >= feedback.rtt_ms) {
+            self.rtts.pop_back();
+        }
+        self.rtts.push_back((ms, feedback.rtt_ms));
+        let min_rtt = self.rtts.front().map_or(feedback.rtt_ms, |r| r.1);
+        let queue_delay = feedback.rtt_ms - min_rtt;
+
+        let congested = feedback.loss > LOSS_HIGH || queue_delay > QUEUE_DELAY_HIGH_MS;
+        // a static screen sends far below the estimate, nothing is learned then
+        let app_limited = sent_kbs < self.estimate_kbs * 0.5;
+        if congested {
+            let hold = (feedback.rtt_ms as u64).max(200);
+            if self.last_decrease_ms.map_or(true, |t| t + hold <= ms) {
+                self.congested_kbs = Some(self.estimate_kbs);
+                self.estimate_kbs = (delivered_kbs * DECREASE_FACTOR).min(self.estimate_kbs);
+                self.last_decrease_ms = Some(ms);
+            }
+        } else if feedback.loss < LOSS_LOW && queue_delay < QUEUE_DELAY_LOW_MS && !app_limited {
+            let seconds = interval_ms as f64 / 1000.0;
+            let near = self
+                .congested_kbs
+                .map_or(false, |c| (self.estimate_kbs - c).abs() < c * 0.1);
+            if near {
+                self.estimate_kbs += INCREASE_NEAR_KBS * seconds;
+            } else {
+                self.estimate_kbs *= INCREASE_FACTOR.powf(seconds);
+            }
+        }
+        self.estimate_kbs = self
+            .estimate_kbs
+            .clamp(self.config.min_kbs as f64, self.config.max_kbs as f64);
+
+        // only overshoot is corrected, an encoder idling on static content is not
+        if !app_limited && self.target.kbs > 0 {
+            let ratio = (sent_kbs / self.target.kbs as f64).clamp(0.5, 2.0);
+            self.overshoot = (self.overshoot * 0.8 + ratio * 0.2).max(1.0);
+        }
+
+        let mut target = self.target;
+        let kbs = (self.estimate_kbs / self.overshoot)
+            .clamp(self.config.min_kbs as f64, self.config.max_kbs as f64);
+        if kbs < target.kbs as f64 * (1.0 - DECREASE_MIN_STEP) {
+            target.kbs = kbs as i32;
+        } else if kbs > target.kbs as f64 * (1.0 + INCREASE_MIN_STEP)
+            && self.last_increase_ms + INCREASE_INTERVAL_MS <= ms
+        {
+            target.kbs = kbs as i32;
+            self.last_increase_ms = ms;
+        }
+
+        if self.last_level_ms + LEVEL_INTERVAL_MS <= ms {
+            let level = self.level;
+            if self.bpp(target.kbs, level) < MIN_BPP && level + 1 < self.levels.len() {
+                self.level += 1;
+            } else if level > 0 && !congested && self.bpp(target.kbs, level - 1) >= LEVEL_UP_BPP {
+                self.level -= 1;
+            }
+            if self.level != level {
+                self.last_level_ms = ms;
+            }
+        }
+        let (fps, num, den) = self.levels[self.level];
+        target.fps = fps;
+        target.width = self.config.width * num / den & !1;
+        target.height = self.config.height * num / den & !1;
+        target.scale_num = num;
+        target.scale_den = den;
+
+        if target != self.target {
+            self.target = target;
+            Some(target)
+        } else {
+            None
+        }
+    }
+
+    fn bpp(&self, kbs: i32, level: usize) -> f64 {
+        let (fps, num, den) = self.levels[level];
+        let pixels =
+            (self.config.width * num / den) as f64 * (self.config.height * num / den) as f64;
+        kbs as f64 * 1000.0 / (pixels * fps as f64).max(1.0)
+    }
+}
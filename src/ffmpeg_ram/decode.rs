@@ -7,21 +7,29 @@ use crate::{
     common::DataFormat::*,
     ffmpeg::{AVHWDeviceType, AVPixelFormat},
     ffmpeg_ram::{
-        ffmpeg_ram_decode, ffmpeg_ram_free_decoder, ffmpeg_ram_new_decoder, CodecInfo,
-        AV_NUM_DATA_POINTERS,
+        ffmpeg_ram_decode, ffmpeg_ram_decode_latest, ffmpeg_ram_frame_info, ffmpeg_ram_free_frame,
+        ffmpeg_ram_get_decode_speed, ffmpeg_ram_new_decoder, ffmpeg_ram_set_decode_speed,
+        ffmpeg_ram_set_preview, reaper, CodecInfo, AV_NUM_DATA_POINTERS,
     },
+    queue::Mailbox,
 };
 use log::error;
 use std::{
     ffi::{c_void, CString},
     os::raw::c_int,
     slice::from_raw_parts,
-    sync::{Arc, Mutex},
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc, Condvar, Mutex,
+    },
     thread,
-    time::Instant,
+    time::{Duration, Instant},
     vec,
 };
 
+// for Decoder::set_speed, follow the packet rate
+pub const DECODE_SPEED_AUTO: i32 = -1;
+
 #[derive(Debug, Clone)]
 pub struct DecodeContext {
     pub name: String,
@@ -36,6 +44,9 @@ pub struct DecodeFrame {
     pub data: Vec<Vec<u8>>,
     pub linesize: Vec<i32>,
     pub key: bool,
+    // first frame, or the stream switched size or pixfmt, e.g. a sender
+    // changing resolution; buffers sized on earlier frames must be resized
+    pub format_changed: bool,
 }
 
 impl std::fmt::Display for DecodeFrame {
@@ -57,9 +68,140 @@ impl std::fmt::Display for DecodeFrame {
     }
 }
 
+// A decoded picture held by reference, not copied. The decoder's buffer is
+// released when the Picture drops.
+pub struct Picture {
+    frame: *mut c_void,
+    data: [*mut u8; AV_NUM_DATA_POINTERS as usize],
+    pub pixfmt: AVPixelFormat,
+    pub width: i32,
+    pub height: i32,
+    pub linesize: Vec<i32>,
+    pub key: bool,
+}
+
+// the frame is never written after decode
+unsafe impl Send for Picture {}
+unsafe impl Sync for Picture {}
+
+impl Picture {
+    unsafe fn new(frame: *mut c_void) -> Option<Self> {
+        let (mut width, mut height, mut pixfmt, mut key) = (0, 0, 0, 0);
+        let mut linesize = [0 as c_int; AV_NUM_DATA_POINTERS as usize];
+        let mut data = [std::ptr::null_mut(); AV_NUM_DATA_POINTERS as usize];
+        ffmpeg_ram_frame_info(
+            frame,
+            &mut width,
+            &mut height,
+            &mut pixfmt,
+            linesize.as_mut_ptr(),
+            data.as_mut_ptr(),
+            &mut key,
+        );
+        let planes = if pixfmt == AVPixelFormat::AV_PIX_FMT_YUV420P as c_int {
+            3
+        } else if pixfmt == AVPixelFormat::AV_PIX_FMT_NV12 as c_int {
+            2
+        } else {
+            error!("unsupported pixfmt {}", pixfmt);
+            ffmpeg_ram_free_frame(frame);
+            return None;
+        };
+        Some(Picture {
+            frame,
+            data,
+            pixfmt: std::mem::transmute(pixfmt),
+            width,
+            height,
+            linesize: linesize[..planes].to_vec(),
+            key: key != 0,
+        })
+    }
+
+    pub fn planes(&self) -> usize {
+        self.linesize.len()
+    }
+
+    // linesize[i] bytes per row, chroma planes have half the rows
+    pub fn plane(&self, i: usize) -> &[u8] {
+        let rows = if i == 0 {
+            self.height
+        } else {
+            (self.height + 1) / 2
+        };
+        unsafe { from_raw_parts(self.data[i], (self.linesize[i] * rows) as usize) }
+    }
+}
+
+impl Drop for Picture {
+    fn drop(&mut self) {
+        unsafe { ffmpeg_ram_free_frame(self.frame) };
+    }
+}
+
+// The newest decoded picture, shared between the decoding and the rendering
+// thread. A newer picture replaces one the renderer hasn't taken, so a slow
+// renderer never makes the decoder copy or queue.
+pub struct LatestFrame {
+    picture: Mailbox<Picture>,
+    // pictures replaced before being taken
+    replaced: AtomicU64,
+    lock: Mutex<()>,
+    cond: Condvar,
+}
+
+impl LatestFrame {
+    fn new() -> Self {
+        Self {
+            picture: Mailbox::new(),
+            replaced: AtomicU64::new(0),
+            lock: Mutex::new(()),
+            cond: Condvar::new(),
+        }
+    }
+
+    fn publish(&self, picture: Picture) {
+        if self.picture.put(picture).is_some() {
+            self.replaced.fetch_add(1, Ordering::Relaxed);
+        }
+        let _guard = self.lock.lock().unwrap();
+        self.cond.notify_all();
+    }
+
+    pub fn take(&self) -> Option<Picture> {
+        self.picture.take()
+    }
+
+    // a new picture is waiting to be taken
+    pub fn available(&self) -> bool {
+        !self.picture.is_empty()
+    }
+
+    // Blocks until a new picture is available or timeout passes.
+    pub fn wait(&self, timeout: Duration) -> Option<Picture> {
+        let deadline = Instant::now() + timeout;
+        let mut guard = self.lock.lock().unwrap();
+        loop {
+            if let Some(picture) = self.take() {
+                return Some(picture);
+            }
+            let now = Instant::now();
+            if now >= deadline {
+                return None;
+            }
+            guard = self.cond.wait_timeout(guard, deadline - now).unwrap().0;
+        }
+    }
+
+    pub fn replaced(&self) -> u64 {
+        self.replaced.load(Ordering::Relaxed)
+    }
+}
+
 pub struct Decoder {
     codec: *mut c_void,
     frames: *mut Vec<DecodeFrame>,
+    latest: Arc<LatestFrame>,
     pub ctx: DecodeContext,
 }
 
@@ -84,6 +226,7 @@ impl Decoder {
             Ok(Decoder {
                 codec,
                 frames: Box::into_raw(Box::new(Vec::<DecodeFrame>::new())),
+                latest: Arc::new(LatestFrame::new()),
                 ctx,
             })
         }
@@ -107,6 +250,68 @@ impl Decoder {
         }
     }
 
+    // Decodes without copying. Only the newest picture of the packet is kept
+    // and published to latest_frame(). Fails like decode if the packet
+    // produced none, Ok(false) for a packet skipped by set_preview.
+    pub fn decode_latest(&mut self, packet: &[u8]) -> Result<bool, i32> {
+        unsafe {
+            let mut frame = std::ptr::null_mut();
+            let ret = ffmpeg_ram_decode_latest(
+                self.codec,
+                packet.as_ptr(),
+                packet.len() as c_int,
+                &mut frame,
+            );
+            if ret < 0 {
+                ffmpeg_ram_free_frame(frame);
+                return Err(ret);
+            }
+            if frame.is_null() {
+                return Ok(false);
+            }
+            self.latest.publish(Picture::new(frame).ok_or(-1)?);
+            Ok(true)
+        }
+    }
+
+    // 0 decodes at full quality, up to 3 skips more and more work: 1 the
+    // loop filter of non-reference frames, 2 the loop filter everywhere and
+    // the idct of non-reference frames, 3 the non-reference frames
+    // themselves. From 2 on artifacts last until the next keyframe. The
+    // streams of hwcodec's own encoders have no non-reference frames, every
+    // P frame is a reference, so on those only the loop filter skip of
+    // level 2 makes a difference. DECODE_SPEED_AUTO steps the level up
+    // while decoding takes most of the packet interval and back down once it
+    // catches up.
+    pub fn set_speed(&mut self, level: i32) -> Result<(), ()> {
+        if unsafe { ffmpeg_ram_set_decode_speed(self.codec, level) } == 0 {
+            Ok(())
+        } else {
+            Err(())
+        }
+    }
+
+    pub fn speed(&self) -> i32 {
+        unsafe { ffmpeg_ram_get_decode_speed(self.codec) }
+    }
+
+    // Cheap live previews. keyframe_only decodes keyframes only, decode
+    // returns no frames for the other packets. Each shift halves the output
+    // size, up to 3. After keyframe_only is turned off, packets are still
+    // skipped until the next keyframe.
+    pub fn set_preview(&mut self, keyframe_only: bool, shift: i32) -> Result<(), ()> {
+        if unsafe { ffmpeg_ram_set_preview(self.codec, keyframe_only as _, shift) } == 0 {
+            Ok(())
+        } else {
+            Err(())
+        }
+    }
+
+    // handed to the renderer, for decode_latest
+    pub fn latest_frame(&self) -> Arc<LatestFrame> {
+        self.latest.clone()
+    }
+
     unsafe extern "C" fn callback(
         obj: *const c_void,
         width: c_int,
@@ -115,6 +320,7 @@ impl Decoder {
         linesizes: *mut c_int,
         datas: *mut *mut u8,
         key: c_int,
+        changed: c_int,
     ) {
         let frames = &mut *(obj as *mut Vec<DecodeFrame>);
         let datas = from_raw_parts(datas, AV_NUM_DATA_POINTERS as _);
@@ -127,6 +333,7 @@ impl Decoder {
             data: vec![],
             linesize: vec![],
             key: key != 0,
+            format_changed: changed != 0,
         };
 
         if pixfmt == AVPixelFormat::AV_PIX_FMT_YUV420P as c_int {
@@ -309,7 +516,7 @@ impl Decoder {
 impl Drop for Decoder {
     fn drop(&mut self) {
         unsafe {
-            ffmpeg_ram_free_decoder(self.codec);
+            reaper::free_decoder(self.codec);
             self.codec = std::ptr::null_mut();
             let _ = Box::from_raw(self.frames);
         }
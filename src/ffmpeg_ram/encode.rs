@@ -5,9 +5,13 @@ use crate::{
     },
     ffmpeg::{init_av_log, AVPixelFormat},
     ffmpeg_ram::{
-        ffmpeg_linesize_offset_length, ffmpeg_ram_encode, ffmpeg_ram_free_encoder,
-        ffmpeg_ram_new_encoder, ffmpeg_ram_set_bitrate, CodecInfo, AV_NUM_DATA_POINTERS,
+        ffmpeg_linesize_offset_length, ffmpeg_ram_encode, ffmpeg_ram_encode_rects,
+        ffmpeg_ram_get_stats, ffmpeg_ram_new_encoder, ffmpeg_ram_reconfigure,
+        ffmpeg_ram_request_keyframe, ffmpeg_ram_set_bitrate, ffmpeg_ram_set_framerate,
+        ffmpeg_ram_set_gop, ffmpeg_ram_set_scale, reaper, CodecInfo, RamEncodeRect, RamEncodeStats,
+        AV_NUM_DATA_POINTERS,
     },
+    nal::{self, NalUnit},
 };
 use log::trace;
 use std::{
@@ -38,12 +42,35 @@ pub struct EncodeContext {
     pub kbs: i32,
     pub q: i32,
     pub thread_count: i32,
+    // > 0: unchanged frames are skipped, but re-encoded at least every
+    // static_keepalive_ms; <= 0: every frame is encoded
+    pub static_keepalive_ms: i32,
+    // > 0: gradual intra refresh over that many frames instead of keyframe
+    // spikes, for libx264, libx265, nvenc, qsv and h264_amf
+    pub intra_refresh: i32,
+    // > 0: upper bound on the encoded frame size, through the vbv. In bytes,
+    // or in milliseconds of link time at kbs; the smaller one wins if both
+    // are set
+    pub max_frame_bytes: i32,
+    pub max_frame_ms: i32,
+    // > 0: percentage of 8x8 luma blocks that must change to force an IDR on
+    // a scene change. Triggers again only after the score fell below half of
+    // it and scene_change_hold_ms passed
+    pub scene_change: i32,
+    pub scene_change_hold_ms: i32,
+    // 2 or 3: temporal layers (L1T2, L1T3) so a forwarder can drop frames of
+    // the upper layers for slow receivers, libvpx only; <= 1: off
+    pub temporal_layers: i32,
 }
 
 pub struct EncodeFrame {
     pub data: Vec<u8>,
     pub pts: i64,
     pub key: i32,
+    // temporal layer, frames of layer n only reference layers <= n
+    pub layer: i32,
+    // the NAL units of data for H.264/H.265, empty for other formats
+    pub nals: Vec<NalUnit>,
 }
 
 impl Display for EncodeFrame {
@@ -55,12 +82,16 @@ impl Display for EncodeFrame {
 pub struct Encoder {
     codec: *mut c_void,
     frames: *mut Vec<EncodeFrame>,
+    // H264 or H265 when the packets are split into EncodeFrame.nals
+    nal_format: Option<DataFormat>,
     pub ctx: EncodeContext,
     pub linesize: Vec<i32>,
     pub offset: Vec<i32>,
     pub length: i32,
 }
 
+unsafe impl Send for Encoder {}
+
 impl Encoder {
     pub fn new(ctx: EncodeContext) -> Result<Self, ()> {
         init_av_log();
@@ -94,6 +125,13 @@ impl Encoder {
                 ctx.q,
                 ctx.thread_count,
                 gpu,
+                ctx.static_keepalive_ms,
+                ctx.intra_refresh,
+                ctx.max_frame_bytes,
+                ctx.max_frame_ms,
+                ctx.scene_change,
+                ctx.scene_change_hold_ms,
+                ctx.temporal_layers,
                 linesize.as_mut_ptr(),
                 offset.as_mut_ptr(),
                 length.as_mut_ptr(),
@@ -104,9 +142,18 @@ impl Encoder {
                 return Err(());
             }
 
+            // libx264 and libx265 carry no "h264"/"hevc"
+            let nal_format = match Encoder::format_from_name(ctx.name.clone()) {
+                Ok(H264) => Some(H264),
+                Ok(H265) => Some(H265),
+                _ if ctx.name.contains("264") => Some(H264),
+                _ if ctx.name.contains("265") => Some(H265),
+                _ => None,
+            };
             Ok(Encoder {
                 codec,
                 frames: Box::into_raw(Box::new(Vec::<EncodeFrame>::new())),
+                nal_format,
                 ctx,
                 linesize,
                 offset,
@@ -128,23 +175,159 @@ impl Encoder {
             if result != 0 {
                 return Err(result);
             }
+            self.split_nals();
+            Ok(&mut *self.frames)
+        }
+    }
+
+    // Like encode, with the regions changed since the previous frame. An empty
+    // slice means nothing changed. Rects with a non-zero qoffset are attached as
+    // regions of interest.
+    pub fn encode_rects(
+        &mut self,
+        data: &[u8],
+        ms: i64,
+        rects: &[RamEncodeRect],
+    ) -> Result<&mut Vec<EncodeFrame>, i32> {
+        unsafe {
+            (&mut *self.frames).clear();
+            let result = ffmpeg_ram_encode_rects(
+                self.codec,
+                (*data).as_ptr(),
+                data.len() as _,
+                self.frames as *const _ as *const c_void,
+                ms,
+                rects.as_ptr(),
+                rects.len() as _,
+            );
+            if result != 0 {
+                return Err(result);
+            }
+            self.split_nals();
             Ok(&mut *self.frames)
         }
     }
 
-    extern "C" fn callback(data: *const u8, size: c_int, pts: i64, key: i32, obj: *const c_void) {
+    // One scan per packet, so packetizers don't search for start codes again.
+    fn split_nals(&mut self) {
+        let Some(format) = self.nal_format else {
+            return;
+        };
+        for frame in unsafe { &mut *self.frames }.iter_mut() {
+            frame.nals = nal::nals(format, &frame.data).map(NalUnit::from).collect();
+        }
+    }
+
+    extern "C" fn callback(
+        data: *const u8,
+        size: c_int,
+        pts: i64,
+        key: i32,
+        layer: i32,
+        obj: *const c_void,
+    ) {
         unsafe {
             let frames = &mut *(obj as *mut Vec<EncodeFrame>);
             frames.push(EncodeFrame {
                 data: slice::from_raw_parts(data, size as _).to_vec(),
                 pts,
                 key,
+                layer,
+                nals: vec![],
             });
         }
     }
 
     pub fn set_bitrate(&mut self, kbs: i32) -> Result<(), ()> {
         let ret = unsafe { ffmpeg_ram_set_bitrate(self.codec, kbs) };
+        if ret == 0 {
+            self.ctx.kbs = kbs;
+            Ok(())
+        } else {
+            Err(())
+        }
+    }
+
+    // The codec is reopened, which restarts with a keyframe, no backend takes
+    // a new framerate in place.
+    pub fn set_framerate(&mut self, fps: i32) -> Result<(), ()> {
+        let ret = unsafe { ffmpeg_ram_set_framerate(self.codec, fps) };
+        if ret == 0 {
+            self.ctx.fps = fps;
+            Ok(())
+        } else {
+            Err(())
+        }
+    }
+
+    // A shorter gop than the initial one is applied in place, a longer one
+    // reopens the codec.
+    pub fn set_gop(&mut self, gop: i32) -> Result<(), ()> {
+        let ret = unsafe { ffmpeg_ram_set_gop(self.codec, gop) };
+        if ret == 0 {
+            self.ctx.gop = gop;
+            Ok(())
+        } else {
+            Err(())
+        }
+    }
+
+    // A new input size on the same encoder, much cheaper than a new one: the hw
+    // device and, with an unchanged encoded size, the hw frames are reused.
+    // Updates linesize, offset and length for the new input layout.
+    pub fn reconfigure(&mut self, width: i32, height: i32) -> Result<(), ()> {
+        let mut linesize = vec![0; AV_NUM_DATA_POINTERS as usize];
+        let mut offset = vec![0; AV_NUM_DATA_POINTERS as usize];
+        let mut length = 0;
+        let ret = unsafe {
+            ffmpeg_ram_reconfigure(
+                self.codec,
+                width,
+                height,
+                linesize.as_mut_ptr(),
+                offset.as_mut_ptr(),
+                &mut length,
+            )
+        };
+        if ret == 0 {
+            self.ctx.width = width;
+            self.ctx.height = height;
+            self.linesize = linesize;
+            self.offset = offset;
+            self.length = length;
+            Ok(())
+        } else {
+            Err(())
+        }
+    }
+
+    // Encodes at num/den of ctx.width x ctx.height: 1/1, 3/4 or 1/2. The input
+    // keeps its size and layout, the downscale runs inside the encoder. Reopens
+    // the codec, which restarts with a keyframe.
+    pub fn set_scale(&mut self, num: i32, den: i32) -> Result<(), ()> {
+        let ret = unsafe { ffmpeg_ram_set_scale(self.codec, num, den) };
+        if ret == 0 {
+            Ok(())
+        } else {
+            Err(())
+        }
+    }
+
+    // Counters since creation, including how often the frame cap was hit.
+    pub fn stats(&self) -> Result<RamEncodeStats, ()> {
+        let mut stats: RamEncodeStats = unsafe { std::mem::zeroed() };
+        let ret = unsafe { ffmpeg_ram_get_stats(self.codec, &mut stats) };
+        if ret == 0 {
+            Ok(stats)
+        } else {
+            Err(())
+        }
+    }
+
+    // The next encoded frame is forced to an IDR, e.g. after packet loss or
+    // when a viewer joins. A backend ignoring the request logs a warning.
+    pub fn request_keyframe(&mut self) -> Result<(), ()> {
+        let ret = unsafe { ffmpeg_ram_request_keyframe(self.codec) };
         if ret == 0 {
             Ok(())
         } else {
@@ -355,7 +538,7 @@ impl Encoder {
 impl Drop for Encoder {
     fn drop(&mut self) {
         unsafe {
-            ffmpeg_ram_free_encoder(self.codec);
+            reaper::free_encoder(self.codec);
             self.codec = std::ptr::null_mut();
             let _ = Box::from_raw(self.frames);
             trace!("Encoder dropped");
@@ -14,6 +14,10 @@ include!(concat!(env!("OUT_DIR"), "/ffmpeg_ram_ffi.rs"));
 
 pub mod decode;
 pub mod encode;
+pub mod pool;
+pub mod reaper;
+pub mod simulcast;
+pub mod threaded;
 
 pub enum Priority {
     Best = 0,
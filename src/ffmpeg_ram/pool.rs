@@ -0,0 +1,249 @@
+// Pre-opened encoders and decoders, so connecting doesn't wait for codec
+// lookup, hw device creation and avcodec_open2. A background thread keeps
+// `per_template` sessions ready for every template and refills after each
+// take. At most `max_sessions` sessions are held in total, a hw session
+// costs device memory.
+
+use crate::ffmpeg_ram::{
+    decode::{DecodeContext, Decoder},
+    encode::{EncodeContext, Encoder},
+};
+use log::warn;
+use std::{
+    sync::{Arc, Condvar, Mutex},
+    thread::{self, JoinHandle},
+    time::{Duration, Instant},
+};
+
+// after a failed open, a template is retried no sooner than this
+const RETRY_INTERVAL: Duration = Duration::from_secs(5);
+
+#[derive(Debug, Clone)]
+pub struct SessionPoolConfig {
+    pub encoders: Vec<EncodeContext>,
+    pub decoders: Vec<DecodeContext>,
+    pub per_template: usize,
+    pub max_sessions: usize,
+}
+
+struct Slot<C, S> {
+    ctx: C,
+    ready: Vec<S>,
+    retry_at: Option<Instant>,
+}
+
+struct State {
+    encoders: Vec<Slot<EncodeContext, Encoder>>,
+    decoders: Vec<Slot<DecodeContext, Decoder>>,
+    stop: bool,
+}
+
+impl State {
+    fn count(&self) -> usize {
+        self.encoders.iter().map(|s| s.ready.len()).sum::<usize>()
+            + self.decoders.iter().map(|s| s.ready.len()).sum::<usize>()
+    }
+}
+
+struct Inner {
+    state: Mutex<State>,
+    cond: Condvar,
+    per_template: usize,
+    max_sessions: usize,
+}
+
+pub struct SessionPool {
+    inner: Arc<Inner>,
+    thread: Option<JoinHandle<()>>,
+}
+
+// only these are adjusted on a pooled encoder, everything else must match
+fn same_encoder(a: &EncodeContext, b: &EncodeContext) -> bool {
+    EncodeContext {
+        kbs: b.kbs,
+        fps: b.fps,
+        gop: b.gop,
+        ..a.clone()
+    } == *b
+}
+
+fn same_decoder(a: &DecodeContext, b: &DecodeContext) -> bool {
+    a.name == b.name && a.device_type == b.device_type && a.thread_count == b.thread_count
+}
+
+impl SessionPool {
+    pub fn new(config: SessionPoolConfig) -> Self {
+        let inner = Arc::new(Inner {
+            state: Mutex::new(State {
+                encoders: config
+                    .encoders
+                    .into_iter()
+                    .map(|ctx| Slot {
+                        ctx,
+                        ready: vec![],
+                        retry_at: None,
+                    })
+                    .collect(),
+                decoders: config
+                    .decoders
+                    .into_iter()
+                    .map(|ctx| Slot {
+                        ctx,
+                        ready: vec![],
+                        retry_at: None,
+                    })
+                    .collect(),
+                stop: false,
+            }),
+            cond: Condvar::new(),
+            per_template: config.per_template,
+            max_sessions: config.max_sessions,
+        });
+        let refill = inner.clone();
+        let thread = thread::spawn(move || refill.run());
+        Self {
+            inner,
+            thread: Some(thread),
+        }
+    }
+
+    // A ready encoder for ctx, with kbs, fps and gop applied, or None on a
+    // miss, the caller then opens one itself.
+    pub fn take_encoder(&self, ctx: &EncodeContext) -> Option<Encoder> {
+        let mut encoder = {
+            let mut state = self.inner.state.lock().unwrap();
+            let slot = state
+                .encoders
+                .iter_mut()
+                .find(|s| same_encoder(&s.ctx, ctx))?;
+            let encoder = slot.ready.pop()?;
+            self.inner.cond.notify_one();
+            encoder
+        };
+        if encoder.ctx.kbs != ctx.kbs && encoder.set_bitrate(ctx.kbs).is_err() {
+            return None;
+        }
+        if encoder.ctx.fps != ctx.fps && encoder.set_framerate(ctx.fps).is_err() {
+            return None;
+        }
+        if encoder.ctx.gop != ctx.gop && encoder.set_gop(ctx.gop).is_err() {
+            return None;
+        }
+        Some(encoder)
+    }
+
+    pub fn take_decoder(&self, ctx: &DecodeContext) -> Option<Decoder> {
+        let mut state = self.inner.state.lock().unwrap();
+        let slot = state
+            .decoders
+            .iter_mut()
+            .find(|s| same_decoder(&s.ctx, ctx))?;
+        let decoder = slot.ready.pop()?;
+        self.inner.cond.notify_one();
+        Some(decoder)
+    }
+
+    // sessions ready to be taken
+    pub fn len(&self) -> usize {
+        self.inner.state.lock().unwrap().count()
+    }
+}
+
+impl Drop for SessionPool {
+    fn drop(&mut self) {
+        self.inner.state.lock().unwrap().stop = true;
+        self.inner.cond.notify_one();
+        if let Some(thread) = self.thread.take() {
+            thread.join().ok();
+        }
+    }
+}
+
+enum Job {
+    Encoder(usize, EncodeContext),
+    Decoder(usize, DecodeContext),
+}
+
+impl Inner {
+    fn run(&self) {
+        loop {
+            let job = {
+                let mut state = self.state.lock().unwrap();
+                loop {
+                    if state.stop {
+                        return;
+                    }
+                    match self.next_job(&state) {
+                        (Some(job), _) => break job,
+                        (None, Some(wait)) => {
+                            state = self.cond.wait_timeout(state, wait).unwrap().0
+                        }
+                        (None, None) => state = self.cond.wait(state).unwrap(),
+                    }
+                }
+            };
+            // opened without the lock, takes stay fast meanwhile
+            match job {
+                Job::Encoder(i, ctx) => {
+                    let encoder = Encoder::new(ctx.clone()).ok();
+                    let mut state = self.state.lock().unwrap();
+                    let slot = &mut state.encoders[i];
+                    match encoder {
+                        Some(encoder) => slot.ready.push(encoder),
+                        None => {
+                            warn!("pool: open encoder {} failed", ctx.name);
+                            slot.retry_at = Some(Instant::now() + RETRY_INTERVAL);
+                        }
+                    }
+                }
+                Job::Decoder(i, ctx) => {
+                    let decoder = Decoder::new(ctx.clone()).ok();
+                    let mut state = self.state.lock().unwrap();
+                    let slot = &mut state.decoders[i];
+                    match decoder {
+                        Some(decoder) => slot.ready.push(decoder),
+                        None => {
+                            warn!("pool: open decoder {} failed", ctx.name);
+                            slot.retry_at = Some(Instant::now() + RETRY_INTERVAL);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // The emptiest template first. Without a job, how long until a failed
+    // template may be retried, if any is waiting.
+    fn next_job(&self, state: &State) -> (Option<Job>, Option<Duration>) {
+        if state.count() >= self.max_sessions {
+            return (None, None);
+        }
+        let now = Instant::now();
+        let mut wait: Option<Duration> = None;
+        let mut best: Option<(usize, Job)> = None;
+        let mut consider = |ready: usize, retry_at: Option<Instant>, job: &dyn Fn() -> Job| {
+            if ready >= self.per_template {
+                return;
+            }
+            if let Some(at) = retry_at.filter(|at| *at > now) {
+                let left = at - now;
+                wait = Some(wait.map_or(left, |w| w.min(left)));
+                return;
+            }
+            if best.as_ref().map_or(true, |b| ready < b.0) {
+                best = Some((ready, job()));
+            }
+        };
+        for (i, slot) in state.encoders.iter().enumerate() {
+            consider(slot.ready.len(), slot.retry_at, &|| {
+                Job::Encoder(i, slot.ctx.clone())
+            });
+        }
+        for (i, slot) in state.decoders.iter().enumerate() {
+            consider(slot.ready.len(), slot.retry_at, &|| {
+                Job::Decoder(i, slot.ctx.clone())
+            });
+        }
+        (best.map(|b| b.1), wait)
+    }
+}
@@ -0,0 +1,104 @@
+// Off-thread teardown. Freeing a codec closes its hw context and joins its
+// threads, which can take tens to hundreds of milliseconds. Once enabled,
+// dropped Encoders and Decoders hand their codec to a dedicated thread
+// instead. At most max_pending teardowns are queued; beyond that, or when
+// disabled, a drop frees synchronously as before.
+
+use crate::ffmpeg_ram::{ffmpeg_ram_free_decoder, ffmpeg_ram_free_encoder};
+use log::{info, warn};
+use std::{
+    ffi::c_void,
+    sync::{
+        mpsc::{self, SyncSender, TrySendError},
+        Mutex,
+    },
+    thread::{self, JoinHandle},
+};
+
+struct Codec(*mut c_void);
+
+// only ever used by the one thread it was handed to
+unsafe impl Send for Codec {}
+
+enum Job {
+    Encoder(Codec),
+    Decoder(Codec),
+    Flush(mpsc::Sender<()>),
+}
+
+struct Reaper {
+    sender: SyncSender<Job>,
+    thread: JoinHandle<()>,
+}
+
+static REAPER: Mutex<Option<Reaper>> = Mutex::new(None);
+
+pub fn enable(max_pending: usize) {
+    let mut reaper = REAPER.lock().unwrap();
+    if reaper.is_some() {
+        return;
+    }
+    let (sender, receiver) = mpsc::sync_channel::<Job>(max_pending.max(1));
+    let thread = thread::spawn(move || {
+        for job in receiver {
+            match job {
+                Job::Encoder(codec) => unsafe { ffmpeg_ram_free_encoder(codec.0) },
+                Job::Decoder(codec) => unsafe { ffmpeg_ram_free_decoder(codec.0) },
+                Job::Flush(done) => {
+                    done.send(()).ok();
+                }
+            }
+        }
+    });
+    *reaper = Some(Reaper { sender, thread });
+    info!("reaper enabled, max pending: {}", max_pending);
+}
+
+// Waits until every teardown queued so far is done, e.g. before shutdown.
+pub fn flush() {
+    let sender = match REAPER.lock().unwrap().as_ref() {
+        Some(reaper) => reaper.sender.clone(),
+        None => return,
+    };
+    let (done, wait) = mpsc::channel();
+    if sender.send(Job::Flush(done)).is_ok() {
+        wait.recv().ok();
+    }
+}
+
+// Flushes and stops the thread, later drops free synchronously.
+pub fn disable() {
+    let reaper = REAPER.lock().unwrap().take();
+    if let Some(reaper) = reaper {
+        drop(reaper.sender);
+        reaper.thread.join().ok();
+    }
+}
+
+pub(crate) fn free_encoder(codec: *mut c_void) {
+    if let Some(Job::Encoder(codec)) = queue(Job::Encoder(Codec(codec))) {
+        unsafe { ffmpeg_ram_free_encoder(codec.0) };
+    }
+}
+
+pub(crate) fn free_decoder(codec: *mut c_void) {
+    if let Some(Job::Decoder(codec)) = queue(Job::Decoder(Codec(codec))) {
+        unsafe { ffmpeg_ram_free_decoder(codec.0) };
+    }
+}
+
+// the job back if it must run on the caller's thread
+fn queue(job: Job) -> Option<Job> {
+    let reaper = REAPER.lock().unwrap();
+    let Some(reaper) = reaper.as_ref() else {
+        return Some(job);
+    };
+    match reaper.sender.try_send(job) {
+        Ok(()) => None,
+        Err(TrySendError::Full(job)) => {
+            warn!("reaper full, free synchronously");
+            Some(job)
+        }
+        Err(TrySendError::Disconnected(job)) => Some(job),
+    }
+}
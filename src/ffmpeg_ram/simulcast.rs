@@ -0,0 +1,231 @@
+// One input encoded at several resolutions and bitrates. Rung i encodes the
+// input downscaled by 2^i, each picture box-filtered from the one above it,
+// so the pyramid is computed once per frame and shared by all rungs. Rung 0
+// encodes on the caller's thread, every other rung on a worker thread kept
+// for the lifetime of the Simulcast.
+
+use crate::ffmpeg_ram::{
+    encode::{EncodeContext, EncodeFrame, Encoder},
+    ffmpeg_ram_downscale_2x,
+};
+use log::error;
+use std::{
+    mem,
+    sync::{mpsc, Arc, Mutex},
+    thread::{self, JoinHandle},
+};
+
+pub struct SimulcastFrame {
+    pub rung: usize,
+    pub frame: EncodeFrame,
+}
+
+type Job = (Vec<u8>, i64);
+// the picture goes back with the packets, to be refilled for the next frame
+type Done = (Vec<u8>, Result<Vec<EncodeFrame>, i32>);
+
+// A rung above 0, encoded on its own thread that lives as long as the
+// Simulcast. The encoder is only locked by the worker while a frame is out.
+struct Worker {
+    encoder: Arc<Mutex<Encoder>>,
+    jobs: Option<mpsc::Sender<Job>>,
+    done: mpsc::Receiver<Done>,
+    thread: Option<JoinHandle<()>>,
+}
+
+impl Worker {
+    fn new(encoder: Encoder) -> Result<Self, ()> {
+        let encoder = Arc::new(Mutex::new(encoder));
+        let (jobs, job_receiver) = mpsc::channel::<Job>();
+        let (done_sender, done) = mpsc::channel::<Done>();
+        let worker_encoder = encoder.clone();
+        let thread = thread::Builder::new()
+            .name("hwcodec-simulcast".to_owned())
+            .spawn(move || {
+                for (picture, ms) in job_receiver {
+                    let result = match worker_encoder.lock() {
+                        Ok(mut encoder) => {
+                            encoder.encode(&picture, ms).map(|f| f.drain(..).collect())
+                        }
+                        Err(_) => Err(-1),
+                    };
+                    if done_sender.send((picture, result)).is_err() {
+                        break;
+                    }
+                }
+            })
+            .map_err(|_| ())?;
+        Ok(Self {
+            encoder,
+            jobs: Some(jobs),
+            done,
+            thread: Some(thread),
+        })
+    }
+}
+
+impl Drop for Worker {
+    fn drop(&mut self) {
+        // closing the channel ends the worker loop
+        self.jobs.take();
+        if let Some(thread) = self.thread.take() {
+            thread.join().ok();
+        }
+    }
+}
+
+// of a rung, for the downscale
+struct Layout {
+    ctx: EncodeContext,
+    linesize: Vec<i32>,
+    offset: Vec<i32>,
+    length: i32,
+}
+
+pub struct Simulcast {
+    first: Encoder,
+    workers: Vec<Worker>,
+    layouts: Vec<Layout>,
+    // downscaled pictures of rungs 1.., rung 0 encodes the caller's buffer
+    pictures: Vec<Vec<u8>>,
+}
+
+impl Simulcast {
+    // kbs[i] is the bitrate of rung i, rung 0 at ctx.width x ctx.height. The
+    // size of every rung must be even and non-zero.
+    pub fn new(ctx: EncodeContext, kbs: &[i32]) -> Result<Self, ()> {
+        let mut encoders = vec![];
+        for (i, kbs) in kbs.iter().enumerate() {
+            let width = ctx.width.checked_shr(i as u32).unwrap_or(0);
+            let height = ctx.height.checked_shr(i as u32).unwrap_or(0);
+            if width <= 0 || height <= 0 || width % 2 == 1 || height % 2 == 1 {
+                error!(
+                    "simulcast rung {} of {}x{} is {}x{}",
+                    i, ctx.width, ctx.height, width, height
+                );
+                return Err(());
+            }
+            encoders.push(Encoder::new(EncodeContext {
+                width,
+                height,
+                kbs: *kbs,
+                ..ctx.clone()
+            })?);
+        }
+        if encoders.is_empty() {
+            return Err(());
+        }
+        let layouts: Vec<_> = encoders
+            .iter()
+            .map(|e| Layout {
+                ctx: e.ctx.clone(),
+                linesize: e.linesize.clone(),
+                offset: e.offset.clone(),
+                length: e.length,
+            })
+            .collect();
+        let pictures = layouts[1..]
+            .iter()
+            .map(|l| vec![0u8; l.length as usize])
+            .collect();
+        let mut encoders = encoders.into_iter();
+        let first = encoders.next().ok_or(())?;
+        let workers = encoders.map(Worker::new).collect::<Result<_, _>>()?;
+        Ok(Self {
+            first,
+            workers,
+            layouts,
+            pictures,
+        })
+    }
+
+    // layout of the input, as for Encoder::encode on rung 0
+    pub fn input(&self) -> &Encoder {
+        &self.first
+    }
+
+    pub fn rungs(&self) -> usize {
+        self.layouts.len()
+    }
+
+    // The packets of all rungs, in rung order. Fails if any rung fails.
+    pub fn encode(&mut self, data: &[u8], ms: i64) -> Result<Vec<SimulcastFrame>, i32> {
+        if data.len() < self.first.length as usize {
+            error!("simulcast input too short: {}", data.len());
+            return Err(-1);
+        }
+        for i in 1..self.layouts.len() {
+            let (src, dst) = (&self.layouts[i - 1], &self.layouts[i]);
+            let (done, rest) = self.pictures.split_at_mut(i - 1);
+            let src_data = if i == 1 { data } else { &done[i - 2][..] };
+            let picture = &mut rest[0];
+            // lost with a worker that died mid frame
+            picture.resize(dst.length as usize, 0);
+            let ret = unsafe {
+                ffmpeg_ram_downscale_2x(
+                    src.ctx.pixfmt as _,
+                    src.ctx.width,
+                    src.ctx.height,
+                    src_data.as_ptr(),
+                    src.linesize.as_ptr(),
+                    src.offset.as_ptr(),
+                    picture.as_mut_ptr(),
+                    dst.linesize.as_ptr(),
+                    dst.offset.as_ptr(),
+                )
+            };
+            if ret != 0 {
+                return Err(ret);
+            }
+        }
+
+        let mut sent = vec![];
+        for (worker, picture) in self.workers.iter().zip(self.pictures.iter_mut()) {
+            let job = (mem::take(picture), ms);
+            sent.push(worker.jobs.as_ref().map_or(false, |j| j.send(job).is_ok()));
+        }
+        let mut results = vec![self.first.encode(data, ms).map(|f| f.drain(..).collect())];
+        for ((worker, picture), sent) in self.workers.iter().zip(self.pictures.iter_mut()).zip(sent)
+        {
+            let result = match sent.then(|| worker.done.recv().ok()).flatten() {
+                Some((p, result)) => {
+                    *picture = p;
+                    result
+                }
+                None => Err(-1),
+            };
+            results.push(result);
+        }
+
+        let mut frames = vec![];
+        for (rung, result) in results.into_iter().enumerate() {
+            frames.extend(
+                result?
+                    .into_iter()
+                    .map(|frame| SimulcastFrame { rung, frame }),
+            );
+        }
+        Ok(frames)
+    }
+
+    pub fn set_bitrate(&mut self, rung: usize, kbs: i32) -> Result<(), ()> {
+        self.with_rung(rung, |e| e.set_bitrate(kbs))
+    }
+
+    pub fn request_keyframe(&mut self, rung: usize) -> Result<(), ()> {
+        self.with_rung(rung, |e| e.request_keyframe())
+    }
+
+    // the workers are idle between encode calls, the lock is never contended
+    fn with_rung<F>(&mut self, rung: usize, f: F) -> Result<(), ()>
+    where
+        F: FnOnce(&mut Encoder) -> Result<(), ()>,
+    {
+        if rung == 0 {
+            return f(&mut self.first);
+        }
+        let worker = self.workers.get(rung - 1).ok_or(())?;
+        let mut encoder = worker.encoder.lock().map_err(|_| ())?;
+        f(&mut encoder)
+    }
+}
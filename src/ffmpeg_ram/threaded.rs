@@ -0,0 +1,242 @@
+// An Encoder owned by its own worker thread. Capture threads hand frames over
+// without blocking: through a bounded spsc ring, where a full ring refuses
+// the frame, or through a latest-wins mailbox, where a frame the worker
+// hasn't started on is replaced by the newer one. Packets come back through
+// a second ring. Settings changes are applied by the worker between frames.
+
+use crate::{
+    ffmpeg_ram::encode::{EncodeContext, EncodeFrame, Encoder},
+    queue::{spsc, Consumer, Mailbox, Producer},
+};
+use log::{error, warn};
+use std::{
+    sync::{
+        atomic::{AtomicBool, AtomicU64, Ordering},
+        mpsc, Arc,
+    },
+    thread::{self, JoinHandle},
+    time::Duration,
+};
+
+pub struct InputFrame {
+    pub data: Vec<u8>,
+    pub ms: i64,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum InputMode {
+    // up to n frames wait, send fails when they are all taken
+    Queue(usize),
+    // only the newest frame waits
+    Latest,
+}
+
+enum Command {
+    SetBitrate(i32),
+    SetFramerate(i32),
+    SetGop(i32),
+    RequestKeyframe,
+}
+
+struct Shared {
+    stop: AtomicBool,
+    latest: Mailbox<InputFrame>,
+    // frames refused or replaced before encoding
+    dropped: AtomicU64,
+    errors: AtomicU64,
+}
+
+pub struct ThreadedEncoder {
+    mode: InputMode,
+    input: Option<Producer<InputFrame>>,
+    output: Consumer<EncodeFrame>,
+    commands: mpsc::Sender<Command>,
+    shared: Arc<Shared>,
+    worker: Option<JoinHandle<()>>,
+    // of the input, as on the Encoder
+    pub ctx: EncodeContext,
+    pub linesize: Vec<i32>,
+    pub offset: Vec<i32>,
+    pub length: i32,
+}
+
+impl ThreadedEncoder {
+    // output_depth bounds the packets waiting for try_recv, the worker stalls
+    // while it is full.
+    pub fn new(ctx: EncodeContext, mode: InputMode, output_depth: usize) -> Result<Self, ()> {
+        let encoder = Encoder::new(ctx.clone())?;
+        let (linesize, offset, length) = (
+            encoder.linesize.clone(),
+            encoder.offset.clone(),
+            encoder.length,
+        );
+        let (input, input_consumer) = match mode {
+            InputMode::Queue(depth) => {
+                let (p, c) = spsc(depth);
+                (Some(p), Some(c))
+            }
+            InputMode::Latest => (None, None),
+        };
+        let (output_producer, output) = spsc(output_depth);
+        let (commands, command_receiver) = mpsc::channel();
+        let shared = Arc::new(Shared {
+            stop: AtomicBool::new(false),
+            latest: Mailbox::new(),
+            dropped: AtomicU64::new(0),
+            errors: AtomicU64::new(0),
+        });
+        let worker_shared = shared.clone();
+        let worker = thread::Builder::new()
+            .name("hwcodec-encode".to_owned())
+            .spawn(move || {
+                run(
+                    encoder,
+                    input_consumer,
+                    output_producer,
+                    command_receiver,
+                    worker_shared,
+                )
+            })
+            .map_err(|_| ())?;
+        Ok(Self {
+            mode,
+            input,
+            output,
+            commands,
+            shared,
+            worker: Some(worker),
+            ctx,
+            linesize,
+            offset,
+            length,
+        })
+    }
+
+    // Never blocks. With InputMode::Queue a full queue returns the frame.
+    pub fn send(&mut self, frame: InputFrame) -> Result<(), InputFrame> {
+        let result = match self.input.as_mut() {
+            Some(input) => input.push(frame),
+            None => {
+                if self.shared.latest.put(frame).is_some() {
+                    self.shared.dropped.fetch_add(1, Ordering::Relaxed);
+                }
+                Ok(())
+            }
+        };
+        if result.is_err() {
+            self.shared.dropped.fetch_add(1, Ordering::Relaxed);
+        }
+        self.unpark();
+        result
+    }
+
+    pub fn try_recv(&mut self) -> Option<EncodeFrame> {
+        let frame = self.output.pop();
+        if frame.is_some() {
+            // the worker may be waiting for room
+            self.unpark();
+        }
+        frame
+    }
+
+    pub fn mode(&self) -> InputMode {
+        self.mode
+    }
+
+    pub fn dropped(&self) -> u64 {
+        self.shared.dropped.load(Ordering::Relaxed)
+    }
+
+    pub fn errors(&self) -> u64 {
+        self.shared.errors.load(Ordering::Relaxed)
+    }
+
+    // Applied by the worker before its next frame, failures are logged.
+    pub fn set_bitrate(&mut self, kbs: i32) {
+        self.command(Command::SetBitrate(kbs));
+        self.ctx.kbs = kbs;
+    }
+
+    pub fn set_framerate(&mut self, fps: i32) {
+        self.command(Command::SetFramerate(fps));
+        self.ctx.fps = fps;
+    }
+
+    pub fn set_gop(&mut self, gop: i32) {
+        self.command(Command::SetGop(gop));
+        self.ctx.gop = gop;
+    }
+
+    pub fn request_keyframe(&mut self) {
+        self.command(Command::RequestKeyframe);
+    }
+
+    fn command(&mut self, command: Command) {
+        self.commands.send(command).ok();
+        self.unpark();
+    }
+
+    fn unpark(&self) {
+        if let Some(worker) = self.worker.as_ref() {
+            worker.thread().unpark();
+        }
+    }
+}
+
+impl Drop for ThreadedEncoder {
+    fn drop(&mut self) {
+        self.shared.stop.store(true, Ordering::Release);
+        if let Some(worker) = self.worker.take() {
+            worker.thread().unpark();
+            worker.join().ok();
+        }
+    }
+}
+
+fn run(
+    mut encoder: Encoder,
+    mut input: Option<Consumer<InputFrame>>,
+    mut output: Producer<EncodeFrame>,
+    commands: mpsc::Receiver<Command>,
+    shared: Arc<Shared>,
+) {
+    while !shared.stop.load(Ordering::Acquire) {
+        for command in commands.try_iter() {
+            let ok = match command {
+                Command::SetBitrate(kbs) => encoder.set_bitrate(kbs),
+                Command::SetFramerate(fps) => encoder.set_framerate(fps),
+                Command::SetGop(gop) => encoder.set_gop(gop),
+                Command::RequestKeyframe => encoder.request_keyframe(),
+            };
+            if ok.is_err() {
+                warn!("threaded encoder: setting change failed");
+            }
+        }
+        let frame = match input.as_mut() {
+            Some(input) => input.pop(),
+            None => shared.latest.take(),
+        };
+        let Some(frame) = frame else {
+            thread::park();
+            continue;
+        };
+        let frames = match encoder.encode(&frame.data, frame.ms) {
+            Ok(frames) => frames,
+            Err(e) => {
+                shared.errors.fetch_add(1, Ordering::Relaxed);
+                error!("threaded encoder: encode failed: {}", e);
+                continue;
+            }
+        };
+        for mut packet in frames.drain(..) {
+            // packets are never dropped, a decoder would lose its references
+            while let Err(p) = output.push(packet) {
+                if shared.stop.load(Ordering::Acquire) {
+                    return;
+                }
+                packet = p;
+                thread::park_timeout(Duration::from_millis(10));
+            }
+        }
+    }
+}
@@ -1,7 +1,11 @@
+pub mod bitrate;
 pub mod common;
 pub mod ffmpeg;
 pub mod ffmpeg_ram;
 pub mod mux;
+pub mod nal;
+pub mod queue;
+pub mod rtp;
 #[cfg(all(windows, feature = "vram"))]
 pub mod vram;
 #[cfg(target_os = "android")]
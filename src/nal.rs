@@ -0,0 +1,514 @@
+// H.264/H.265 Annex-B parsing without decoding, for forwarders that route or
+// cache packets by NAL type, keyframe or resolution.
+//
+// Everything borrows the input: NAL units are slices of it and the SPS/VPS
+// reader skips emulation prevention bytes on the fly instead of copying out
+// the RBSP. Malformed input yields None or fewer NALs, never a panic.
+
+use crate::common::DataFormat::{self, *};
+
+// H.264 nal_unit_type
+pub const H264_NAL_SLICE: u8 = 1;
+pub const H264_NAL_IDR: u8 = 5;
+pub const H264_NAL_SEI: u8 = 6;
+pub const H264_NAL_SPS: u8 = 7;
+pub const H264_NAL_PPS: u8 = 8;
+pub const H264_NAL_AUD: u8 = 9;
+
+// H.265 nal_unit_type, IRAP pictures are 16 ..= 23
+pub const H265_NAL_BLA_W_LP: u8 = 16;
+pub const H265_NAL_IDR_W_RADL: u8 = 19;
+pub const H265_NAL_IDR_N_LP: u8 = 20;
+pub const H265_NAL_CRA: u8 = 21;
+pub const H265_NAL_IRAP_END: u8 = 23;
+pub const H265_NAL_VPS: u8 = 32;
+pub const H265_NAL_SPS: u8 = 33;
+pub const H265_NAL_PPS: u8 = 34;
+pub const H265_NAL_AUD: u8 = 35;
+pub const H265_NAL_SEI_PREFIX: u8 = 39;
+
+// larger coded sizes are rejected as corrupt
+const MAX_DIMENSION: u64 = 16384;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct Nal<'a> {
+    pub format: DataFormat,
+    // of the NAL header in the input, after the start code
+    pub offset: usize,
+    // header and payload, emulation prevention bytes included
+    pub data: &'a [u8],
+    pub nal_type: u8,
+}
+
+impl<'a> Nal<'a> {
+    // IDR for H.264, any IRAP (IDR, CRA, BLA) for H.265
+    pub fn is_keyframe(&self) -> bool {
+        match self.format {
+            H264 => self.nal_type == H264_NAL_IDR,
+            H265 => (H265_NAL_BLA_W_LP..=H265_NAL_IRAP_END).contains(&self.nal_type),
+            _ => false,
+        }
+    }
+
+    pub fn is_idr(&self) -> bool {
+        match self.format {
+            H264 => self.nal_type == H264_NAL_IDR,
+            H265 => self.nal_type == H265_NAL_IDR_W_RADL || self.nal_type == H265_NAL_IDR_N_LP,
+            _ => false,
+        }
+    }
+
+    // VPS, SPS or PPS
+    pub fn is_parameter_set(&self) -> bool {
+        match self.format {
+            H264 => self.nal_type == H264_NAL_SPS || self.nal_type == H264_NAL_PPS,
+            H265 => (H265_NAL_VPS..=H265_NAL_PPS).contains(&self.nal_type),
+            _ => false,
+        }
+    }
+
+    // a coded slice of a picture
+    pub fn is_slice(&self) -> bool {
+        match self.format {
+            H264 => (H264_NAL_SLICE..=H264_NAL_IDR).contains(&self.nal_type),
+            H265 => self.nal_type <= H265_NAL_IRAP_END,
+            _ => false,
+        }
+    }
+
+    // H.265 TemporalId, 0 for H.264
+    pub fn temporal_id(&self) -> u8 {
+        match self.format {
+            H265 if self.data.len() >= 2 => (self.data[1] & 0x07).saturating_sub(1),
+            _ => 0,
+        }
+    }
+}
+
+// The NAL units of an Annex-B buffer, in order. Bytes before the first start
+// code are skipped, trailing zero bytes aren't part of a NAL.
+pub struct Nals<'a> {
+    format: DataFormat,
+    data: &'a [u8],
+    // where the next NAL's header starts, None when done
+    next: Option<usize>,
+}
+
+pub fn nals(format: DataFormat, data: &[u8]) -> Nals<'_> {
+    let next = match format {
+        H264 | H265 => find_start_code(data, 0),
+        _ => None,
+    };
+    Nals { format, data, next }
+}
+
+impl<'a> Iterator for Nals<'a> {
+    type Item = Nal<'a>;
+
+    fn next(&mut self) -> Option<Nal<'a>> {
+        loop {
+            let start = self.next?;
+            self.next = find_start_code(self.data, start);
+            let mut end = match self.next {
+                // back over the 00 00 01 of the next NAL
+                Some(next) => next - 3,
+                None => self.data.len(),
+            };
+            while end > start && self.data[end - 1] == 0 {
+                end -= 1;
+            }
+            let data = &self.data[start..end];
+            let header_len = if self.format == H265 { 2 } else { 1 };
+            // forbidden_zero_bit set or too short, not a NAL
+            if data.len() < header_len || data[0] & 0x80 != 0 {
+                continue;
+            }
+            let nal_type = match self.format {
+                H265 => (data[0] >> 1) & 0x3f,
+                _ => data[0] & 0x1f,
+            };
+            return Some(Nal {
+                format: self.format,
+                offset: start,
+                data,
+                nal_type,
+            });
+        }
+    }
+}
+
+// position after the next 00 00 01 at or after from
+fn find_start_code(data: &[u8], from: usize) -> Option<usize> {
+    let mut i = from + 2;
+    while i < data.len() {
+        // the third byte decides, skip ahead as far as it allows
+        match data[i] {
+            1 if data[i - 1] == 0 && data[i - 2] == 0 => return Some(i + 1),
+            0 | 1 => i += 1,
+            _ => i += 3,
+        }
+    }
+    None
+}
+
+// Where a NAL sits in a packet, without borrowing it, e.g. to keep with an
+// owned packet.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct NalUnit {
+    // of the NAL header, after the start code
+    pub offset: usize,
+    pub len: usize,
+    pub nal_type: u8,
+}
+
+impl NalUnit {
+    // the NAL in the packet it was found in
+    pub fn data<'a>(&self, packet: &'a [u8]) -> &'a [u8] {
+        &packet[self.offset..self.offset + self.len]
+    }
+}
+
+impl From<Nal<'_>> for NalUnit {
+    fn from(nal: Nal) -> Self {
+        Self {
+            offset: nal.offset,
+            len: nal.data.len(),
+            nal_type: nal.nal_type,
+        }
+    }
+}
+
+// The packet contains a keyframe slice, see Nal::is_keyframe.
+pub fn is_keyframe(format: DataFormat, data: &[u8]) -> bool {
+    nals(format, data).any(|nal| nal.is_keyframe())
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+pub struct Sps {
+    pub id: u32,
+    // profile_idc and level_idc as coded: for H.264 level 3.1 is 31, for
+    // H.265 it is 93, 30 times the level
+    pub profile: u8,
+    pub level: u8,
+    // H.265 high tier, false for H.264
+    pub high_tier: bool,
+    pub chroma_format: u8,
+    pub bit_depth: u8,
+    // cropped, the size of the decoded picture
+    pub width: u32,
+    pub height: u32,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
+pub struct Vps {
+    pub id: u8,
+    pub max_sub_layers: u8,
+    pub profile: u8,
+    pub level: u8,
+    pub high_tier: bool,
+}
+
+// The first SPS of the buffer, as sent with every keyframe.
+pub fn find_sps(format: DataFormat, data: &[u8]) -> Option<Sps> {
+    nals(format, data)
+        .filter(|nal| match format {
+            H264 => nal.nal_type == H264_NAL_SPS,
+            _ => nal.nal_type == H265_NAL_SPS,
+        })
+        .find_map(|nal| parse_sps(&nal))
+}
+
+pub fn parse_sps(nal: &Nal) -> Option<Sps> {
+    match (nal.format, nal.nal_type) {
+        (H264, H264_NAL_SPS) => parse_h264_sps(BitReader::new(&nal.data[1..])),
+        (H265, H265_NAL_SPS) => parse_h265_sps(BitReader::new(&nal.data[2..])),
+        _ => None,
+    }
+}
+
+pub fn parse_vps(nal: &Nal) -> Option<Vps> {
+    if nal.format != H265 || nal.nal_type != H265_NAL_VPS {
+        return None;
+    }
+    let mut r = BitReader::new(&nal.data[2..]);
+    let id = r.bits(4)? as u8;
+    r.skip(2)?; // base_layer_internal_flag, base_layer_available_flag
+    r.skip(6)?; // max_layers_minus1
+    let max_sub_layers_minus1 = r.bits(3)? as u8;
+    r.skip(1 + 16)?; // temporal_id_nesting_flag, reserved 0xffff
+    let ptl = profile_tier_level(&mut r, max_sub_layers_minus1)?;
+    Some(Vps {
+        id,
+        max_sub_layers: max_sub_layers_minus1 + 1,
+        profile: ptl.profile,
+        level: ptl.level,
+        high_tier: ptl.high_tier,
+    })
+}
+
+fn parse_h264_sps(mut r: BitReader) -> Option<Sps> {
+    let profile = r.bits(8)? as u8;
+    r.skip(8)?; // constraint_set flags
+    let level = r.bits(8)? as u8;
+    let id = r.ue()?;
+    let mut chroma_format = 1;
+    let mut separate_colour_plane = false;
+    let mut bit_depth = 8;
+    if matches!(
+        profile,
+        100 | 110 | 122 | 244 | 44 | 83 | 86 | 118 | 128 | 138 | 139 | 134 | 135
+    ) {
+        chroma_format = r.ue()?;
+        if chroma_format > 3 {
+            return None;
+        }
+        if chroma_format == 3 {
+            separate_colour_plane = r.bit()? == 1;
+        }
+        bit_depth = bit_depth_minus8(&mut r)? + 8;
+        r.ue()?; // bit_depth_chroma_minus8
+        r.skip(1)?; // qpprime_y_zero_transform_bypass_flag
+        if r.bit()? == 1 {
+            // seq_scaling_matrix_present_flag
+            for i in 0..if chroma_format == 3 { 12 } else { 8 } {
+                if r.bit()? == 1 {
+                    skip_scaling_list(&mut r, if i < 6 { 16 } else { 64 })?;
+                }
+            }
+        }
+    }
+    r.ue()?; // log2_max_frame_num_minus4
+    match r.ue()? {
+        0 => {
+            r.ue()?; // log2_max_pic_order_cnt_lsb_minus4
+        }
+        1 => {
+            r.skip(1)?; // delta_pic_order_always_zero_flag
+            r.se()?; // offset_for_non_ref_pic
+            r.se()?; // offset_for_top_to_bottom_field
+            for _ in 0..r.ue()? {
+                r.se()?; // offset_for_ref_frame
+            }
+        }
+        2 => {}
+        _ => return None,
+    }
+    r.ue()?; // max_num_ref_frames
+    r.skip(1)?; // gaps_in_frame_num_value_allowed_flag
+    let width_mbs = r.ue()? as u64 + 1;
+    let height_map_units = r.ue()? as u64 + 1;
+    let frame_mbs_only = r.bit()? as u64;
+    if frame_mbs_only == 0 {
+        r.skip(1)?; // mb_adaptive_frame_field_flag
+    }
+    r.skip(1)?; // direct_8x8_inference_flag
+    let mut width = width_mbs * 16;
+    let mut height = (2 - frame_mbs_only) * height_map_units * 16;
+    if r.bit()? == 1 {
+        // frame_cropping_flag, in chroma samples and per field
+        let (sub_width, sub_height) = match (separate_colour_plane, chroma_format) {
+            (true, _) | (_, 0) | (_, 3) => (1, 1),
+            (_, 2) => (2, 1),
+            _ => (2, 2),
+        };
+        let crop_x = sub_width;
+        let crop_y = sub_height * (2 - frame_mbs_only);
+        let (left, right) = (r.ue()? as u64, r.ue()? as u64);
+        let (top, bottom) = (r.ue()? as u64, r.ue()? as u64);
+        width = width.checked_sub(crop_x * (left + right))?;
+        height = height.checked_sub(crop_y * (top + bottom))?;
+    }
+    if width == 0 || height == 0 || width > MAX_DIMENSION || height > MAX_DIMENSION {
+        return None;
+    }
+    Some(Sps {
+        id,
+        profile,
+        level,
+        high_tier: false,
+        chroma_format: chroma_format as u8,
+        bit_depth: bit_depth as u8,
+        width: width as u32,
+        height: height as u32,
+    })
+}
+
+// up to 16 bits for both codecs
+fn bit_depth_minus8(r: &mut BitReader) -> Option<u32> {
+    r.ue().filter(|v| *v <= 8)
+}
+
+fn skip_scaling_list(r: &mut BitReader, size: usize) -> Option<()> {
+    let (mut last, mut next) = (8i64, 8i64);
+    for _ in 0..size {
+        if next != 0 {
+            next = (last + r.se()? as i64 + 256).rem_euclid(256);
+        }
+        if next != 0 {
+            last = next;
+        }
+    }
+    Some(())
+}
+
+fn parse_h265_sps(mut r: BitReader) -> Option<Sps> {
+    r.skip(4)?; // sps_video_parameter_set_id
+    let max_sub_layers_minus1 = r.bits(3)? as u8;
+    r.skip(1)?; // sps_temporal_id_nesting_flag
+    let ptl = profile_tier_level(&mut r, max_sub_layers_minus1)?;
+    let id = r.ue()?;
+    let chroma_format = r.ue()?;
+    if chroma_format > 3 {
+        return None;
+    }
+    let mut separate_colour_plane = false;
+    if chroma_format == 3 {
+        separate_colour_plane = r.bit()? == 1;
+    }
+    let mut width = r.ue()? as u64;
+    let mut height = r.ue()? as u64;
+    if r.bit()? == 1 {
+        // conformance_window_flag, in chroma samples
+        let (sub_width, sub_height) = match (separate_colour_plane, chroma_format) {
+            (true, _) | (_, 0) | (_, 3) => (1, 1),
+            (_, 2) => (2, 1),
+            _ => (2, 2),
+        };
+        let (left, right) = (r.ue()? as u64, r.ue()? as u64);
+        let (top, bottom) = (r.ue()? as u64, r.ue()? as u64);
+        width = width.checked_sub(sub_width * (left + right))?;
+        height = height.checked_sub(sub_height * (top + bottom))?;
+    }
+    let bit_depth = bit_depth_minus8(&mut r)? + 8;
+    if width == 0 || height == 0 || width > MAX_DIMENSION || height > MAX_DIMENSION {
+        return None;
+    }
+    Some(Sps {
+        id,
+        profile: ptl.profile,
+        level: ptl.level,
+        high_tier: ptl.high_tier,
+        chroma_format: chroma_format as u8,
+        bit_depth: bit_depth as u8,
+        width: width as u32,
+        height: height as u32,
+    })
+}
+
+struct ProfileTierLevel {
+    profile: u8,
+    level: u8,
+    high_tier: bool,
+}
+
+// H.265 profile_tier_level() with profilePresentFlag 1
+fn profile_tier_level(r: &mut BitReader, max_sub_layers_minus1: u8) -> Option<ProfileTierLevel> {
+    r.skip(2)?; // general_profile_space
+    let high_tier = r.bit()? == 1;
+    let profile = r.bits(5)? as u8;
+    // compatibility flags, source flags and the 43 + 1 reserved or
+    // constraint bits
+    r.skip(32 + 4 + 44)?;
+    let level = r.bits(8)? as u8;
+    let mut sub_layers = [(false, false); 8];
+    for layer in sub_layers.iter_mut().take(max_sub_layers_minus1 as usize) {
+        *layer = (r.bit()? == 1, r.bit()? == 1);
+    }
+    if max_sub_layers_minus1 > 0 {
+        for _ in max_sub_layers_minus1..8 {
+            r.skip(2)?; // reserved_zero_2bits
+        }
+    }
+    for (profile_present, level_present) in sub_layers.iter().take(max_sub_layers_minus1 as usize) {
+        if *profile_present {
+            r.skip(88)?;
+        }
+        if *level_present {
+            r.skip(8)?;
+        }
+    }
+    Some(ProfileTierLevel {
+        profile,
+        level,
+        high_tier,
+    })
+}
+
+// Reads the RBSP of a NAL payload, dropping the 03 of every 00 00 03.
+struct BitReader<'a> {
+    data: &'a [u8],
+    pos: usize,
+    // zero bytes just read, for emulation prevention
+    zeros: usize,
+    cur: u8,
+    // bits of cur not read yet
+    left: u32,
+}
+
+impl<'a> BitReader<'a> {
+    fn new(data: &'a [u8]) -> Self {
+        Self {
+            data,
+            pos: 0,
+            zeros: 0,
+            cur: 0,
+            left: 0,
+        }
+    }
+
+    fn load(&mut self) -> Option<()> {
+        let mut byte = *self.data.get(self.pos)?;
+        self.pos += 1;
+        if self.zeros >= 2 && byte == 3 {
+            byte = *self.data.get(self.pos)?;
+            self.pos += 1;
+            self.zeros = 0;
+        }
+        self.zeros = if byte == 0 { self.zeros + 1 } else { 0 };
+        self.cur = byte;
+        self.left = 8;
+        Some(())
+    }
+
+    fn bit(&mut self) -> Option<u32> {
+        if self.left == 0 {
+            self.load()?;
+        }
+        self.left -= 1;
+        Some(((self.cur >> self.left) & 1) as u32)
+    }
+
+    // n <= 32
+    fn bits(&mut self, n: u32) -> Option<u32> {
+        let mut v = 0u64;
+        for _ in 0..n {
+            v = v << 1 | self.bit()? as u64;
+        }
+        Some(v as u32)
+    }
+
+    fn skip(&mut self, n: u32) -> Option<()> {
+        for _ in 0..n {
+            self.bit()?;
+        }
+        Some(())
+    }
+
+    // Exp-Golomb, values beyond 32 bits are treated as corrupt
+    fn ue(&mut self) -> Option<u32> {
+        let mut zeros = 0;
+        while self.bit()? == 0 {
+            zeros += 1;
+            if zeros > 31 {
+                return None;
+            }
+        }
+        let v = (1u64 << zeros) - 1 + self.bits(zeros)? as u64;
+        u32::try_from(v).ok()
+    }
+
+    fn se(&mut self) -> Option<i32> {
+        let v = self.ue()? as i64;
+        Some(if v & 1 == 1 { (v + 1) / 2 } else { -(v / 2) } as i32)
+    }
+}
@@ -0,0 +1,162 @@
+// Lock-free hand-over between two threads.
+//
+// spsc is a bounded single-producer single-consumer queue. Mailbox holds one
+// value and a put replaces whatever the reader hasn't taken yet, for
+// latest-wins delivery. Neither blocks, the threads park and unpark around
+// them.
+
+use std::{
+    cell::UnsafeCell,
+    mem::MaybeUninit,
+    ptr,
+    sync::{
+        atomic::{AtomicPtr, AtomicUsize, Ordering},
+        Arc,
+    },
+};
+
+struct Ring<T> {
+    slots: Box<[UnsafeCell<MaybeUninit<T>>]>,
+    // next slot to pop, only the consumer writes it
+    head: AtomicUsize,
+    // next slot to push, only the producer writes it
+    tail: AtomicUsize,
+}
+
+// One Producer pushes and one Consumer pops, each slot belongs to exactly one
+// of them at a time.
+unsafe impl<T: Send> Send for Ring<T> {}
+unsafe impl<T: Send> Sync for Ring<T> {}
+
+impl<T> Ring<T> {
+    fn len(&self) -> usize {
+        let head = self.head.load(Ordering::Acquire);
+        let tail = self.tail.load(Ordering::Acquire);
+        (tail + self.slots.len() - head) % self.slots.len()
+    }
+}
+
+impl<T> Drop for Ring<T> {
+    fn drop(&mut self) {
+        let tail = *self.tail.get_mut();
+        let mut head = *self.head.get_mut();
+        while head != tail {
+            unsafe { (*self.slots[head].get()).assume_init_drop() };
+            head = (head + 1) % self.slots.len();
+        }
+    }
+}
+
+pub struct Producer<T> {
+    ring: Arc<Ring<T>>,
+}
+
+pub struct Consumer<T> {
+    ring: Arc<Ring<T>>,
+}
+
+// A bounded ring of capacity values, the two ends go to two threads.
+pub fn spsc<T>(capacity: usize) -> (Producer<T>, Consumer<T>) {
+    // one slot stays empty to tell full from empty
+    let slots = (0..capacity.max(1) + 1)
+        .map(|_| UnsafeCell::new(MaybeUninit::uninit()))
+        .collect();
+    let ring = Arc::new(Ring {
+        slots,
+        head: AtomicUsize::new(0),
+        tail: AtomicUsize::new(0),
+    });
+    (Producer { ring: ring.clone() }, Consumer { ring })
+}
+
+impl<T> Producer<T> {
+    // The value comes back if the ring is full.
+    pub fn push(&mut self, value: T) -> Result<(), T> {
+        let ring = &self.ring;
+        let tail = ring.tail.load(Ordering::Relaxed);
+        let next = (tail + 1) % ring.slots.len();
+        if next == ring.head.load(Ordering::Acquire) {
+            return Err(value);
+        }
+        unsafe { (*ring.slots[tail].get()).write(value) };
+        ring.tail.store(next, Ordering::Release);
+        Ok(())
+    }
+
+    pub fn len(&self) -> usize {
+        self.ring.len()
+    }
+}
+
+impl<T> Consumer<T> {
+    pub fn pop(&mut self) -> Option<T> {
+        let ring = &self.ring;
+        let head = ring.head.load(Ordering::Relaxed);
+        if head == ring.tail.load(Ordering::Acquire) {
+            return None;
+        }
+        let value = unsafe { (*ring.slots[head].get()).assume_init_read() };
+        ring.head
+            .store((head + 1) % ring.slots.len(), Ordering::Release);
+        Some(value)
+    }
+
+    pub fn len(&self) -> usize {
+        self.ring.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+}
+
+pub struct Mailbox<T> {
+    value: AtomicPtr<T>,
+}
+
+unsafe impl<T: Send> Send for Mailbox<T> {}
+unsafe impl<T: Send> Sync for Mailbox<T> {}
+
+impl<T> Mailbox<T> {
+    pub fn new() -> Self {
+        Self {
+            value: AtomicPtr::new(ptr::null_mut()),
+        }
+    }
+
+    // Returns the value it replaced, which the reader never saw.
+    pub fn put(&self, value: T) -> Option<T> {
+        let old = self
+            .value
+            .swap(Box::into_raw(Box::new(value)), Ordering::AcqRel);
+        Self::unbox(old)
+    }
+
+    pub fn take(&self) -> Option<T> {
+        Self::unbox(self.value.swap(ptr::null_mut(), Ordering::AcqRel))
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.value.load(Ordering::Acquire).is_null()
+    }
+
+    fn unbox(p: *mut T) -> Option<T> {
+        if p.is_null() {
+            None
+        } else {
+            Some(*unsafe { Box::from_raw(p) })
+        }
+    }
+}
+
+impl<T> Default for Mailbox<T> {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl<T> Drop for Mailbox<T> {
+    fn drop(&mut self) {
+        self.take();
+    }
+}
@@ -0,0 +1,565 @@
+// RTP payloads for H.264 (RFC 6184) and H.265 (RFC 7798).
+//
+// Packetizer splits an access unit into MTU-sized packets in
+// non-interleaved mode: small NAL units are aggregated (STAP-A / AP), large
+// ones fragmented (FU-A / FU), the rest sent as is. A packet is a small owned
+// header plus slices of the encoded frame, written out with
+// RtpPacket::iovecs, so the payload is never copied.
+//
+// Depacketizer buffers packets by sequence number to undo reordering and
+// rebuilds Annex-B access units for the decoder. A gap that is still open
+// after reorder_window packets counts as loss: the broken access unit is
+// dropped and the next one is flagged, it decodes only from a keyframe on.
+
+use crate::{
+    common::DataFormat::{self, *},
+    ffmpeg_ram::encode::EncodeFrame,
+    nal::{self, NalUnit},
+};
+use std::{collections::BTreeMap, io::IoSlice};
+
+pub const RTP_HEADER_SIZE: usize = 12;
+// RTP clock of video payloads
+pub const CLOCK_RATE: u32 = 90000;
+
+const H264_STAP_A: u8 = 24;
+const H264_FU_A: u8 = 28;
+const H265_AP: u8 = 48;
+const H265_FU: u8 = 49;
+const FU_START: u8 = 0x80;
+const FU_END: u8 = 0x40;
+// NAL units per aggregation packet, bounds the owned header bytes
+const MAX_AGGREGATED: usize = 16;
+// RTP header, aggregation header and a 2 byte size per NAL
+const MAX_HEAD: usize = RTP_HEADER_SIZE + 2 + 2 * MAX_AGGREGATED;
+
+#[derive(Debug, Clone)]
+pub struct RtpConfig {
+    // of a whole RTP packet, without the IP and UDP headers
+    pub mtu: usize,
+    pub payload_type: u8,
+    pub ssrc: u32,
+    pub first_seq: u16,
+}
+
+enum Span<'a> {
+    // a range of RtpPacket.head
+    Head(usize, usize),
+    Payload(&'a [u8]),
+}
+
+pub struct RtpPacket<'a> {
+    head: [u8; MAX_HEAD],
+    head_len: usize,
+    spans: Vec<Span<'a>>,
+}
+
+impl<'a> RtpPacket<'a> {
+    fn new(header: [u8; RTP_HEADER_SIZE]) -> Self {
+        let mut head = [0u8; MAX_HEAD];
+        head[..RTP_HEADER_SIZE].copy_from_slice(&header);
+        Self {
+            head,
+            head_len: RTP_HEADER_SIZE,
+            spans: vec![Span::Head(0, RTP_HEADER_SIZE)],
+        }
+    }
+
+    // Owned bytes, merged with the previous span when that is owned too.
+    fn push_head(&mut self, bytes: &[u8]) {
+        let start = self.head_len;
+        self.head[start..start + bytes.len()].copy_from_slice(bytes);
+        self.head_len += bytes.len();
+        match self.spans.last_mut() {
+            Some(Span::Head(_, end)) if *end == start => *end = self.head_len,
+            _ => self.spans.push(Span::Head(start, self.head_len)),
+        }
+    }
+
+    fn push_payload(&mut self, payload: &'a [u8]) {
+        self.spans.push(Span::Payload(payload));
+    }
+
+    fn set_marker(&mut self) {
+        self.head[1] |= 0x80;
+    }
+
+    // For write_vectored or sendmsg, in order.
+    pub fn iovecs(&self) -> Vec<IoSlice<'_>> {
+        self.spans
+            .iter()
+            .map(|span| match span {
+                Span::Head(start, end) => IoSlice::new(&self.head[*start..*end]),
+                Span::Payload(payload) => IoSlice::new(payload),
+            })
+            .collect()
+    }
+
+    pub fn len(&self) -> usize {
+        self.spans
+            .iter()
+            .map(|span| match span {
+                Span::Head(start, end) => end - start,
+                Span::Payload(payload) => payload.len(),
+            })
+            .sum()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    pub fn seq(&self) -> u16 {
+        u16::from_be_bytes([self.head[2], self.head[3]])
+    }
+
+    // a copy, for transports without scatter-gather
+    pub fn to_vec(&self) -> Vec<u8> {
+        let mut v = Vec::with_capacity(self.len());
+        for iovec in self.iovecs() {
+            v.extend_from_slice(&iovec);
+        }
+        v
+    }
+}
+
+pub struct Packetizer {
+    format: DataFormat,
+    config: RtpConfig,
+    seq: u16,
+}
+
+impl Packetizer {
+    // H264 or H265, the mtu must leave room for a fragment header. The
+    // payload is capped at 65535, the size field of an aggregated NAL unit.
+    pub fn new(format: DataFormat, config: RtpConfig) -> Result<Self, ()> {
+        if !matches!(format, H264 | H265)
+            || config.mtu < RTP_HEADER_SIZE + 16
+            || config.mtu > RTP_HEADER_SIZE + u16::MAX as usize
+        {
+            return Err(());
+        }
+        Ok(Self {
+            format,
+            seq: config.first_seq,
+            config,
+        })
+    }
+
+    // The packets of one encoded frame, the last one carries the marker bit.
+    // timestamp is in CLOCK_RATE units, e.g. pts in ms * 90.
+    pub fn packetize<'a>(&mut self, frame: &'a EncodeFrame, timestamp: u32) -> Vec<RtpPacket<'a>> {
+        if frame.nals.is_empty() {
+            let nals: Vec<NalUnit> = nal::nals(self.format, &frame.data)
+                .map(NalUnit::from)
+                .collect();
+            self.packetize_nals(&frame.data, &nals, timestamp)
+        } else {
+            self.packetize_nals(&frame.data, &frame.nals, timestamp)
+        }
+    }
+
+    pub fn packetize_nals<'a>(
+        &mut self,
+        data: &'a [u8],
+        nals: &[NalUnit],
+        timestamp: u32,
+    ) -> Vec<RtpPacket<'a>> {
+        let max_payload = self.config.mtu - RTP_HEADER_SIZE;
+        let header_len = self.nal_header_len();
+        let mut packets = vec![];
+        // NAL units waiting to be aggregated and their aggregated size
+        let mut pending: Vec<&'a [u8]> = vec![];
+        let mut pending_size = header_len;
+        for unit in nals {
+            let nal = unit.data(data);
+            if nal.len() < header_len {
+                continue;
+            }
+            if nal.len() > max_payload {
+                self.flush(&mut pending, timestamp, &mut packets);
+                pending_size = header_len;
+                self.fragment(nal, max_payload, timestamp, &mut packets);
+                continue;
+            }
+            if pending.len() == MAX_AGGREGATED || pending_size + 2 + nal.len() > max_payload {
+                self.flush(&mut pending, timestamp, &mut packets);
+                pending_size = header_len;
+            }
+            pending.push(nal);
+            pending_size += 2 + nal.len();
+        }
+        self.flush(&mut pending, timestamp, &mut packets);
+        if let Some(last) = packets.last_mut() {
+            last.set_marker();
+        }
+        packets
+    }
+
+    fn nal_header_len(&self) -> usize {
+        if self.format == H265 {
+            2
+        } else {
+            1
+        }
+    }
+
+    fn header(&mut self, timestamp: u32) -> [u8; RTP_HEADER_SIZE] {
+        let mut h = [0u8; RTP_HEADER_SIZE];
+        h[0] = 0x80; // version 2
+        h[1] = self.config.payload_type & 0x7f;
+        h[2..4].copy_from_slice(&self.seq.to_be_bytes());
+        h[4..8].copy_from_slice(&timestamp.to_be_bytes());
+        h[8..12].copy_from_slice(&self.config.ssrc.to_be_bytes());
+        self.seq = self.seq.wrapping_add(1);
+        h
+    }
+
+    // one NAL as a single NAL unit packet, more as one aggregation packet
+    fn flush<'a>(
+        &mut self,
+        pending: &mut Vec<&'a [u8]>,
+        timestamp: u32,
+        packets: &mut Vec<RtpPacket<'a>>,
+    ) {
+        if pending.is_empty() {
+            return;
+        }
+        let mut packet = RtpPacket::new(self.header(timestamp));
+        if pending.len() == 1 {
+            packet.push_payload(pending[0]);
+        } else {
+            match self.format {
+                H265 => {
+                    // lowest LayerId and TemporalId of the aggregated units
+                    let layer = pending
+                        .iter()
+                        .map(|n| ((n[0] & 1) << 5) | (n[1] >> 3))
+                        .min()
+                        .unwrap_or(0);
+                    let tid = pending.iter().map(|n| n[1] & 7).min().unwrap_or(1);
+                    let forbidden = pending.iter().fold(0, |f, n| f | (n[0] & 0x80));
+                    packet.push_head(&[
+                        forbidden | (H265_AP << 1) | (layer >> 5),
+                        ((layer & 0x1f) << 3) | tid,
+                    ]);
+                }
+                _ => {
+                    let forbidden = pending.iter().fold(0, |f, n| f | (n[0] & 0x80));
+                    let nri = pending.iter().map(|n| n[0] & 0x60).max().unwrap_or(0);
+                    packet.push_head(&[forbidden | nri | H264_STAP_A]);
+                }
+            }
+            for nal in pending.iter() {
+                packet.push_head(&(nal.len() as u16).to_be_bytes());
+                packet.push_payload(nal);
+            }
+        }
+        packets.push(packet);
+        pending.clear();
+    }
+
+    fn fragment<'a>(
+        &mut self,
+        nal: &'a [u8],
+        max_payload: usize,
+        timestamp: u32,
+        packets: &mut Vec<RtpPacket<'a>>,
+    ) {
+        let header_len = self.nal_header_len();
+        // the NAL header is carried in the payload and FU headers instead
+        let (fu_head, nal_type): ([u8; 2], u8) = match self.format {
+            H265 => (
+                [(nal[0] & 0x81) | (H265_FU << 1), nal[1]],
+                (nal[0] >> 1) & 0x3f,
+            ),
+            _ => ([(nal[0] & 0xe0) | H264_FU_A, 0], nal[0] & 0x1f),
+        };
+        let chunk = max_payload - header_len - 1;
+        let body = &nal[header_len..];
+        let count = (body.len() + chunk - 1) / chunk;
+        for (i, part) in body.chunks(chunk).enumerate() {
+            let mut flags = 0;
+            if i == 0 {
+                flags |= FU_START;
+            }
+            if i + 1 == count {
+                flags |= FU_END;
+            }
+            let mut packet = RtpPacket::new(self.header(timestamp));
+            packet.push_head(&fu_head[..header_len]);
+            packet.push_head(&[flags | nal_type]);
+            packet.push_payload(part);
+            packets.push(packet);
+        }
+    }
+}
+
+pub struct AccessUnit {
+    // Annex-B, ready for Decoder::decode
+    pub data: Vec<u8>,
+    pub timestamp: u32,
+    pub keyframe: bool,
+    // packets before it were lost, it decodes only if it is a keyframe or
+    // nothing it references was lost
+    pub discontinuity: bool,
+}
+
+struct Received {
+    marker: bool,
+    timestamp: u32,
+    payload: Vec<u8>,
+}
+
+pub struct Depacketizer {
+    format: DataFormat,
+    reorder_window: usize,
+    // by extended sequence number, all at or after next
+    packets: BTreeMap<u64, Received>,
+    // extended sequence number of the next packet to assemble, None before
+    // the first packet
+    next: Option<u64>,
+    // an access unit was popped or dropped, until then an earlier packet
+    // moves next back
+    started: bool,
+    discontinuity: bool,
+    lost: u64,
+}
+
+impl Depacketizer {
+    // reorder_window is how many packets may arrive past a gap before the
+    // gap counts as loss
+    pub fn new(format: DataFormat, reorder_window: usize) -> Result<Self, ()> {
+        if !matches!(format, H264 | H265) {
+            return Err(());
+        }
+        Ok(Self {
+            format,
+            reorder_window: reorder_window.max(1),
+            packets: BTreeMap::new(),
+            next: None,
+            started: false,
+            discontinuity: false,
+            lost: 0,
+        })
+    }
+
+    // A received RTP packet. Late and duplicate packets are ignored, a
+    // malformed one is an error.
+    pub fn push(&mut self, packet: &[u8]) -> Result<(), ()> {
+        if packet.len() < RTP_HEADER_SIZE || packet[0] >> 6 != 2 {
+            return Err(());
+        }
+        let mut start = RTP_HEADER_SIZE + 4 * (packet[0] & 0x0f) as usize;
+        let mut end = packet.len();
+        if packet[0] & 0x20 != 0 {
+            // padding, the last byte counts it
+            end = end
+                .checked_sub(*packet.last().ok_or(())? as usize)
+                .ok_or(())?;
+        }
+        if packet[0] & 0x10 != 0 {
+            // header extension, 4 bytes and a length in words
+            let ext = packet.get(start..start + 4).ok_or(())?;
+            start += 4 + 4 * u16::from_be_bytes([ext[2], ext[3]]) as usize;
+        }
+        if start >= end {
+            return Err(());
+        }
+        let seq = u16::from_be_bytes([packet[2], packet[3]]);
+        // far from 0, a wrap of the 16 bit number never underflows it
+        let next = *self.next.get_or_insert(1 << 32 | seq as u64);
+        let ext = (next as i64 + seq.wrapping_sub(next as u16) as i16 as i64) as u64;
+        if ext < next {
+            if self.started {
+                return Ok(());
+            }
+            self.next = Some(ext);
+        }
+        self.packets.entry(ext).or_insert(Received {
+            marker: packet[1] & 0x80 != 0,
+            timestamp: u32::from_be_bytes([packet[4], packet[5], packet[6], packet[7]]),
+            payload: packet[start..end].to_vec(),
+        });
+        Ok(())
+    }
+
+    // The next complete access unit, in order, or None until more packets
+    // arrive.
+    pub fn pop(&mut self) -> Option<AccessUnit> {
+        loop {
+            let next = self.next?;
+            // contiguous packets from next up to a marker make an access unit
+            let mut seq = next;
+            let mut marker = None;
+            while let Some(packet) = self.packets.get(&seq) {
+                if packet.marker {
+                    marker = Some(seq);
+                    break;
+                }
+                seq += 1;
+            }
+            if let Some(last) = marker {
+                let packets: Vec<Received> = (next..=last)
+                    .filter_map(|seq| self.packets.remove(&seq))
+                    .collect();
+                self.next = Some(last + 1);
+                self.started = true;
+                match self.assemble(&packets) {
+                    Some(mut unit) => {
+                        unit.discontinuity = std::mem::take(&mut self.discontinuity);
+                        return Some(unit);
+                    }
+                    None => {
+                        self.discontinuity = true;
+                        continue;
+                    }
+                }
+            }
+            // wait while fewer than reorder_window packets arrived past the
+            // first missing one, seq
+            let newest = *self.packets.keys().next_back()?;
+            if seq > newest || newest - seq < self.reorder_window as u64 {
+                return None;
+            }
+            // the gap at seq is loss, drop the access unit it belongs to. It
+            // ends at its marker, or, with the marker lost too, before the
+            // first packet of another timestamp. When the gap opens the
+            // access unit, a first packet after it that starts a NAL unit
+            // starts the next one, or what is left of this one, which goes
+            // out marked as a discontinuity.
+            let (first_seq, first) = self.packets.range(seq..).next()?;
+            let timestamp = match seq.checked_sub(1).and_then(|s| self.packets.get(&s)) {
+                Some(packet) => Some(packet.timestamp),
+                None if self.starts_nal(&first.payload) => None,
+                None => Some(first.timestamp),
+            };
+            let mut resume = *first_seq;
+            if let Some(timestamp) = timestamp {
+                resume = newest + 1;
+                for (seq, packet) in self.packets.range(seq..) {
+                    if packet.timestamp != timestamp {
+                        resume = *seq;
+                        break;
+                    }
+                    if packet.marker {
+                        resume = seq + 1;
+                        break;
+                    }
+                }
+            }
+            self.lost += (next..resume)
+                .filter(|seq| !self.packets.contains_key(seq))
+                .count() as u64;
+            self.packets = self.packets.split_off(&resume);
+            self.next = Some(resume);
+            self.started = true;
+            self.discontinuity = true;
+        }
+    }
+
+    // packets given up on, a packet arriving after its access unit was
+    // dropped counts too
+    pub fn lost(&self) -> u64 {
+        self.lost
+    }
+
+    // Annex-B from the payloads of one access unit, None if malformed, e.g.
+    // a fragmented NAL unit missing its start after a loss.
+    fn assemble(&self, packets: &[Received]) -> Option<AccessUnit> {
+        let mut data = vec![];
+        let mut keyframe = false;
+        let mut in_fragment = false;
+        let header_len = if self.format == H265 { 2 } else { 1 };
+        for packet in packets {
+            let p = &packet.payload[..];
+            if p.len() < header_len {
+                return None;
+            }
+            let packet_type = match self.format {
+                H265 => (p[0] >> 1) & 0x3f,
+                _ => p[0] & 0x1f,
+            };
+            let (aggregated, fragmented) = match self.format {
+                H265 => (packet_type == H265_AP, packet_type == H265_FU),
+                _ => (packet_type == H264_STAP_A, packet_type == H264_FU_A),
+            };
+            if in_fragment && !fragmented {
+                return None;
+            }
+            if aggregated {
+                let mut rest = &p[header_len..];
+                while !rest.is_empty() {
+                    let size = u16::from_be_bytes([rest[0], *rest.get(1)?]) as usize;
+                    let nal = rest.get(2..2 + size)?;
+                    if nal.len() < header_len {
+                        return None;
+                    }
+                    keyframe |= self.is_keyframe(nal);
+                    Self::push_nal(&mut data, nal);
+                    rest = &rest[2 + size..];
+                }
+            } else if fragmented {
+                let fu = *p.get(header_len)?;
+                let body = &p[header_len + 1..];
+                if fu & FU_START != 0 {
+                    if in_fragment {
+                        return None;
+                    }
+                    let nal_type = fu & 0x3f;
+                    match self.format {
+                        H265 => Self::push_nal(&mut data, &[(p[0] & 0x81) | (nal_type << 1), p[1]]),
+                        _ => Self::push_nal(&mut data, &[(p[0] & 0xe0) | (fu & 0x1f)]),
+                    }
+                    keyframe |= self.is_keyframe(&data[data.len() - header_len..]);
+                    in_fragment = true;
+                } else if !in_fragment {
+                    return None;
+                }
+                data.extend_from_slice(body);
+                if fu & FU_END != 0 {
+                    in_fragment = false;
+                }
+            } else {
+                keyframe |= self.is_keyframe(p);
+                Self::push_nal(&mut data, p);
+            }
+        }
+        if in_fragment || data.is_empty() {
+            return None;
+        }
+        Some(AccessUnit {
+            data,
+            timestamp: packets.first()?.timestamp,
+            keyframe,
+            discontinuity: false,
+        })
+    }
+
+    // false for the continuation of a fragmented NAL unit
+    fn starts_nal(&self, payload: &[u8]) -> bool {
+        let (fu, fragmented) = match self.format {
+            H265 => (payload.get(2), (payload[0] >> 1) & 0x3f == H265_FU),
+            _ => (payload.get(1), payload[0] & 0x1f == H264_FU_A),
+        };
+        !fragmented || fu.map_or(false, |fu| fu & FU_START != 0)
+    }
+
+    fn push_nal(data: &mut Vec<u8>, nal: &[u8]) {
+        data.extend_from_slice(&[0, 0, 0, 1]);
+        data.extend_from_slice(nal);
+    }
+
+    fn is_keyframe(&self, nal: &[u8]) -> bool {
+        nal::Nal {
+            format: self.format,
+            offset: 0,
+            data: nal,
+            nal_type: match self.format {
+                H265 => (nal[0] >> 1) & 0x3f,
+                _ => nal[0] & 0x1f,
+            },
+        }
+        .is_keyframe()
+    }
+}